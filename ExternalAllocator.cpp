@@ -2,6 +2,9 @@
 #include <stdio.h>
 #include <stdlib.h>
 
+#include <new>
+#include <algorithm>
+
 template <typename T>
 T RoundDown(T a, T b)
 {
@@ -17,8 +20,249 @@ T RoundUp(T a, T b)
 static void Assert(bool cond) {if (!cond) abort();}
 
 
+//#pragma mark - TlsfIndex
+
+void ExternalAllocator::TlsfIndex::Mapping(uint64_t size, uint32_t &fl, uint32_t &sl)
+{
+	if (size < kSlCount) {
+		fl = 0;
+		sl = (uint32_t)size;
+		return;
+	}
+	uint32_t msb = 63 - __builtin_clzll(size);
+	fl = msb - kSlBits + 1;
+	sl = (uint32_t)(size >> (msb - kSlBits)) - kSlCount;
+}
+
+void ExternalAllocator::TlsfIndex::Insert(Block* block)
+{
+	uint32_t fl, sl;
+	Mapping(block->fSize, fl, sl);
+	Block* &head = lists[fl][sl];
+	block->fFreeLink.prev = NULL;
+	block->fFreeLink.next = head;
+	if (head != NULL)
+		head->fFreeLink.prev = block;
+	head = block;
+	flBitmap |= (uint64_t)1 << fl;
+	slBitmap[fl] |= (uint32_t)1 << sl;
+}
+
+void ExternalAllocator::TlsfIndex::Remove(Block* block)
+{
+	uint32_t fl, sl;
+	Mapping(block->fSize, fl, sl);
+	if (block->fFreeLink.prev != NULL)
+		block->fFreeLink.prev->fFreeLink.next = block->fFreeLink.next;
+	else
+		lists[fl][sl] = block->fFreeLink.next;
+	if (block->fFreeLink.next != NULL)
+		block->fFreeLink.next->fFreeLink.prev = block->fFreeLink.prev;
+	if (lists[fl][sl] == NULL) {
+		slBitmap[fl] &= ~((uint32_t)1 << sl);
+		if (slBitmap[fl] == 0)
+			flBitmap &= ~((uint64_t)1 << fl);
+	}
+}
+
+// Returns the first block of the first class whose blocks all fit. Only if
+// there is none, the class of size itself is searched, so allocations don't
+// fail while a fitting block exists.
+ExternalAllocator::Block* ExternalAllocator::TlsfIndex::Find(uint64_t size)
+{
+	uint32_t fl, sl;
+	uint64_t rounded = size;
+	if (size >= kSlCount)
+		rounded += ((uint64_t)1 << (63 - __builtin_clzll(size) - kSlBits)) - 1;
+	if (rounded >= size) {
+		Mapping(rounded, fl, sl);
+		uint32_t slMap = slBitmap[fl] & (~(uint32_t)0 << sl);
+		if (slMap == 0) {
+			uint64_t flMap = flBitmap & (~(uint64_t)0 << (fl + 1));
+			if (flMap != 0) {
+				fl = __builtin_ctzll(flMap);
+				slMap = slBitmap[fl];
+			}
+		}
+		if (slMap != 0)
+			return lists[fl][__builtin_ctz(slMap)];
+	}
+
+	Mapping(size, fl, sl);
+	for (Block* block = lists[fl][sl]; block != NULL; block = block->fFreeLink.next) {
+		if (block->fSize >= size)
+			return block;
+	}
+	return NULL;
+}
+
+
+//#pragma mark - BitmapIndex
+
+ExternalAllocator::BitmapIndex::~BitmapIndex()
+{
+	delete[] words;
+	delete[] summary;
+}
+
+// Returns the index of the first word in [from, to) that differs from value,
+// or to. Four words are checked per step with integer registers only, the
+// kernel must not touch the FPU or vector state.
+uint64_t ExternalAllocator::BitmapIndex::FindWordNot(const uint64_t* words, uint64_t from, uint64_t to, uint64_t value)
+{
+	uint64_t i = from;
+	for (; i + 4 <= to; i += 4) {
+		if (((words[i] ^ value) | (words[i + 1] ^ value) | (words[i + 2] ^ value) | (words[i + 3] ^ value)) != 0)
+			break;
+	}
+	for (; i < to; i++) {
+		if (words[i] != value)
+			return i;
+	}
+	return to;
+}
+
+// Makes the words cover the first bitCount units. Units past the registered
+// size are marked allocated.
+bool ExternalAllocator::BitmapIndex::Grow(uint64_t bitCount)
+{
+	if (bitCount <= wordCount * 64)
+		return true;
+	uint64_t maxCount = RoundUp<uint64_t>(RoundUp<uint64_t>(size, 64) / 64, 64);
+	uint64_t newCount = std::max<uint64_t>(wordCount * 2, RoundUp<uint64_t>(RoundUp<uint64_t>(bitCount, 64) / 64, 64));
+	newCount = std::min(newCount, maxCount);
+
+	uint64_t* newWords = new(std::nothrow) uint64_t[newCount];
+	uint64_t* newSummary = new(std::nothrow) uint64_t[newCount / 64];
+	if (newWords == NULL || newSummary == NULL) {
+		delete[] newWords;
+		delete[] newSummary;
+		return false;
+	}
+	std::copy(words, words + wordCount, newWords);
+	std::fill(newWords + wordCount, newWords + newCount, 0);
+	std::copy(summary, summary + wordCount / 64, newSummary);
+	std::fill(newSummary + wordCount / 64, newSummary + newCount / 64, 0);
+	delete[] words;
+	delete[] summary;
+	uint64_t oldCount = wordCount;
+	words = newWords;
+	summary = newSummary;
+	wordCount = newCount;
+	if (newCount * 64 > size)
+		SetRange(std::max(size, oldCount * 64), newCount * 64, true);
+	return true;
+}
+
+// Returns the first free unit at or after from, or size if there is none.
+uint64_t ExternalAllocator::BitmapIndex::FindZero(uint64_t from)
+{
+	if (from >= size)
+		return size;
+	uint64_t w = from / 64;
+	if (w >= wordCount)
+		return from;
+	uint64_t word = words[w] | ((((uint64_t)1) << (from % 64)) - 1);
+	if (word != ~(uint64_t)0)
+		return w * 64 + __builtin_ctzll(~word);
+
+	// skip full words through the summary
+	w++;
+	uint64_t s = w / 64;
+	if (w % 64 != 0) {
+		uint64_t sum = summary[s] | ((((uint64_t)1) << (w % 64)) - 1);
+		if (sum != ~(uint64_t)0) {
+			w = s * 64 + __builtin_ctzll(~sum);
+			return w * 64 + __builtin_ctzll(~words[w]);
+		}
+		s++;
+	}
+	s = FindWordNot(summary, s, wordCount / 64, ~(uint64_t)0);
+	if (s == wordCount / 64)
+		return std::min(wordCount * 64, size);
+	w = s * 64 + __builtin_ctzll(~summary[s]);
+	return w * 64 + __builtin_ctzll(~words[w]);
+}
+
+// Returns the first allocated unit in [from, to), or to.
+uint64_t ExternalAllocator::BitmapIndex::FindSet(uint64_t from, uint64_t to)
+{
+	uint64_t end = std::min(to, wordCount * 64);
+	while (from < end && from % 64 != 0) {
+		if ((words[from / 64] & ((uint64_t)1 << (from % 64))) != 0)
+			return from;
+		from++;
+	}
+	if (from >= end)
+		return to;
+	uint64_t w = FindWordNot(words, from / 64, end / 64, 0);
+	if (w < end / 64)
+		return w * 64 + __builtin_ctzll(words[w]);
+	for (from = end / 64 * 64; from < end; from++) {
+		if ((words[from / 64] & ((uint64_t)1 << (from % 64))) != 0)
+			return from;
+	}
+	return to;
+}
+
+void ExternalAllocator::BitmapIndex::SetRange(uint64_t from, uint64_t to, bool allocated)
+{
+	while (from < to) {
+		uint64_t w = from / 64;
+		uint64_t bits = std::min<uint64_t>(to - from, 64 - from % 64);
+		uint64_t mask = (bits == 64 ? ~(uint64_t)0 : (((uint64_t)1 << bits) - 1)) << (from % 64);
+		if (allocated)
+			words[w] |= mask;
+		else
+			words[w] &= ~mask;
+		uint64_t summaryBit = (uint64_t)1 << (w % 64);
+		if (words[w] == ~(uint64_t)0)
+			summary[w / 64] |= summaryBit;
+		else
+			summary[w / 64] &= ~summaryBit;
+		from += bits;
+	}
+}
+
+// Finds count free units in a row whose address is a multiple of align.
+bool ExternalAllocator::BitmapIndex::FindRun(uint64_t count, uint64_t align, uint64_t &bit)
+{
+	uint64_t candidate = firstFreeWord * 64;
+	for (;;) {
+		candidate = FindZero(candidate);
+		if (candidate >= size)
+			return false;
+		if (align > 1)
+			candidate = RoundUp(base + candidate, align) - base;
+		if (candidate >= size || count > size - candidate)
+			return false;
+		uint64_t allocated = FindSet(candidate, candidate + count);
+		if (allocated == candidate + count) {
+			bit = candidate;
+			return true;
+		}
+		candidate = allocated + 1;
+	}
+}
+
+
+//#pragma mark - ExternalAllocator
+
+ExternalAllocator::ExternalAllocator(Mode mode)
+{
+	if (mode == kTlsf) {
+		fTlsf = new(std::nothrow) TlsfIndex();
+		Assert(fTlsf != NULL);
+	} else if (mode == kBitmap) {
+		fBitmap = new(std::nothrow) BitmapIndex();
+		Assert(fBitmap != NULL);
+	}
+}
+
 ExternalAllocator::~ExternalAllocator()
 {
+	delete fTlsf;
+	delete fBitmap;
 	fSizeMap.Clear();
 	for (;;) {
 		Block *block = fAdrMap.LeftMost();
@@ -26,29 +270,86 @@ ExternalAllocator::~ExternalAllocator()
 		fAdrMap.Remove(block);
 		delete block;
 	}
+	while (fUnusedBlocks != NULL) {
+		Block *block = fUnusedBlocks;
+		fUnusedBlocks = block->fNextUnused;
+		delete block;
+	}
+}
+
+ExternalAllocator::Block* ExternalAllocator::NewBlock(uint64_t adr, uint64_t size)
+{
+	Block *block = fUnusedBlocks;
+	if (block == NULL)
+		return new(std::nothrow) Block(adr, size);
+	fUnusedBlocks = block->fNextUnused;
+	return new(block) Block(adr, size);
+}
+
+void ExternalAllocator::DeleteBlock(Block* block)
+{
+	block->fNextUnused = fUnusedBlocks;
+	fUnusedBlocks = block;
+}
+
+void ExternalAllocator::InsertFree(Block* block)
+{
+	if (fTlsf != NULL)
+		fTlsf->Insert(block);
+	else
+		fSizeMap.Insert(block);
+}
+
+void ExternalAllocator::RemoveFree(Block* block)
+{
+	if (fTlsf != NULL)
+		fTlsf->Remove(block);
+	else
+		fSizeMap.Remove(block);
+}
+
+ExternalAllocator::Block* ExternalAllocator::FindFree(uint64_t size)
+{
+	if (fTlsf != NULL)
+		return fTlsf->Find(size);
+	return fSizeMap.FindClosest(size, false);
 }
 
 void ExternalAllocator::Register(uint64_t ptr, uint64_t size)
 {
-	Block *block = new Block(ptr, size);
+	if (fBitmap != NULL) {
+		Assert(fBitmap->size == 0);
+		fBitmap->base = ptr;
+		fBitmap->size = size;
+		fTotalSize += size;
+		return;
+	}
+	Block *block = NewBlock(ptr, size);
+	Assert(block != NULL);
 	fAdrMap.Insert(block);
-	fSizeMap.Insert(block);
+	InsertFree(block);
 	fTotalSize += size;
 }
 
 bool ExternalAllocator::Alloc(uint64_t &ptr, uint64_t size)
 {
-	Block *block = fSizeMap.FindClosest(size, false);
+	if (fBitmap != NULL)
+		return BitmapAlloc(ptr, size, 1);
+
+	Block *block = FindFree(size);
 	if (block == NULL)
 		return false;
 
-	fSizeMap.Remove(block);
 	if (block->fSize > size) {
-		Block *remainingBlock = new Block(block->fAdr + size, block->fSize - size);
+		Block *remainingBlock = NewBlock(block->fAdr + size, block->fSize - size);
+		if (remainingBlock == NULL)
+			return false;
+		RemoveFree(block);
 		fAdrMap.Insert(remainingBlock);
-		fSizeMap.Insert(remainingBlock);
+		InsertFree(remainingBlock);
 		block->fSize = size;
-	}
+	} else
+		RemoveFree(block);
 
 	block->fAllocated = true;
 	ptr = block->fAdr;
@@ -58,7 +359,10 @@ bool ExternalAllocator::Alloc(uint64_t &ptr, uint64_t size)
 
 bool ExternalAllocator::AllocAligned(uint64_t &ptr, uint64_t size, uint64_t align)
 {
-	Block *block = fSizeMap.FindClosest(size + (align - 1), false);
+	if (fBitmap != NULL)
+		return BitmapAlloc(ptr, size, align);
+
+	Block *block = FindFree(size + (align - 1));
 	if (block == NULL)
 		return false;
 
@@ -69,66 +373,225 @@ bool ExternalAllocator::AllocAligned(uint64_t &ptr, uint64_t size, uint64_t alig
 
 bool ExternalAllocator::AllocAt(uint64_t ptr, uint64_t size)
 {
+	if (fBitmap != NULL)
+		return BitmapAllocAt(ptr, size);
+
 	Block *block = fAdrMap.FindClosest(ptr, true);
 
 	if (block == NULL || block->fAllocated || !(ptr >= block->fAdr && ptr + size <= block->fAdr + block->fSize))
 		return false;
 
+	// get both blocks a split may need before changing anything
+	Block *left = NULL;
 	if (block->fAdr < ptr) {
-		Block *left = block;
-		block = new Block(ptr, left->fSize - (ptr - left->fAdr));
+		left = NewBlock(block->fAdr, ptr - block->fAdr);
+		if (left == NULL)
+			return false;
+	}
+	Block *right = NULL;
+	if (ptr + size < block->fAdr + block->fSize) {
+		right = NewBlock(ptr + size, block->fAdr + block->fSize - (ptr + size));
+		if (right == NULL) {
+			if (left != NULL)
+				DeleteBlock(left);
+			return false;
+		}
+	}
+
+	RemoveFree(block);
+	if (left != NULL) {
+		fAdrMap.Remove(block);
+		block->fAdr = ptr;
+		fAdrMap.Insert(left);
+		InsertFree(left);
 		fAdrMap.Insert(block);
-		fSizeMap.Insert(block);
-		fSizeMap.Remove(left);
-		left->fSize = ptr - left->fAdr;
-		fSizeMap.Insert(left);
 	}
-	if (block->fSize > size) {
-		Block *right = new Block(ptr + size, block->fSize - size);
+	if (right != NULL) {
 		fAdrMap.Insert(right);
-		fSizeMap.Insert(right);
-
-		fSizeMap.Remove(block);
-		block->fSize = size;
-		fSizeMap.Insert(block);
+		InsertFree(right);
 	}
-
-	fSizeMap.Remove(block);
+	block->fSize = size;
 	block->fAllocated = true;
 	fAllocSize += block->fSize;
 	return true;
 }
 
-void ExternalAllocator::Free(uint64_t ptr)
+bool ExternalAllocator::AllocMany(uint64_t* ptrs, uint32_t count, uint64_t size)
 {
-	Block *block = fAdrMap.Find(ptr);
+	if (size == 0)
+		return false;
+
+	if (fBitmap != NULL) {
+		for (uint32_t i = 0; i < count; i++) {
+			if (!BitmapAlloc(ptrs[i], size, 1)) {
+				FreeMany(ptrs, i);
+				return false;
+			}
+		}
+		return true;
+	}
+
+	uint32_t done = 0;
+	bool ok = true;
+	while (ok && done < count) {
+		Block *block = FindFree(size);
+		if (block == NULL) {
+			ok = false;
+			break;
+		}
+
+		// carve as many ranges as fit, the rest goes back to the size map
+		// once
+		RemoveFree(block);
+		while (block != NULL && done < count && block->fSize >= size) {
+			Block *rest = NULL;
+			if (block->fSize > size) {
+				rest = NewBlock(block->fAdr + size, block->fSize - size);
+				if (rest == NULL) {
+					ok = false;
+					break;
+				}
+				fAdrMap.Insert(rest);
+				block->fSize = size;
+			}
+			block->fAllocated = true;
+			fAllocSize += size;
+			ptrs[done++] = block->fAdr;
+			block = rest;
+		}
+		if (block != NULL)
+			InsertFree(block);
+	}
+
+	if (!ok) {
+		FreeMany(ptrs, done);
+		return false;
+	}
+	return true;
+}
+
+// Frees the block at ptrs[0] and the following ranges as long as they are
+// the next blocks, returns the number of ranges freed. The merged block is
+// inserted into the size map once.
+uint32_t ExternalAllocator::FreeRun(const uint64_t* ptrs, uint32_t count)
+{
+	Block *block = fAdrMap.Find(ptrs[0]);
 	if (block == NULL || !block->fAllocated) abort();
-	fSizeMap.Insert(block);
 	block->fAllocated = false;
 	fAllocSize -= block->fSize;
 
 	Block *prev = fAdrMap.Previous(block);
 	if (prev != NULL && !prev->fAllocated) {
-		fSizeMap.Remove(prev);
+		RemoveFree(prev);
 		prev->fSize += block->fSize;
-
 		fAdrMap.Remove(block);
-		fSizeMap.Remove(block);
-		delete block;
-
+		DeleteBlock(block);
 		block = prev;
-		fSizeMap.Insert(block);
 	}
 
-	Block *next = fAdrMap.Next(block);
-	if (next != NULL && !next->fAllocated) {
-		fSizeMap.Remove(block);
+	uint32_t num = 1;
+	for (;;) {
+		Block *next = fAdrMap.Next(block);
+		if (next == NULL)
+			break;
+		if (next->fAllocated) {
+			if (num == count || next->fAdr != ptrs[num])
+				break;
+			num++;
+			fAllocSize -= next->fSize;
+		} else
+			RemoveFree(next);
 		block->fSize += next->fSize;
-
 		fAdrMap.Remove(next);
-		fSizeMap.Remove(next);
-		delete next;
+		DeleteBlock(next);
+	}
 
-		fSizeMap.Insert(block);
+	InsertFree(block);
+	return num;
+}
+
+void ExternalAllocator::Free(uint64_t ptr)
+{
+	if (fBitmap != NULL)
+		BitmapFree(ptr);
+	else
+		FreeRun(&ptr, 1);
+}
+
+void ExternalAllocator::FreeMany(uint64_t* ptrs, uint32_t count)
+{
+	if (fBitmap != NULL) {
+		// nothing to coalesce, sorting would only cost time
+		for (uint32_t i = 0; i < count; i++)
+			BitmapFree(ptrs[i]);
+		return;
+	}
+	std::sort(ptrs, ptrs + count);
+	for (uint32_t i = 0; i < count; )
+		i += FreeRun(ptrs + i, count - i);
+}
+
+
+//#pragma mark - Bitmap mode
+
+bool ExternalAllocator::BitmapAlloc(uint64_t &ptr, uint64_t size, uint64_t align)
+{
+	if (size == 0)
+		return false;
+	uint64_t bit;
+	if (size == 1 && align <= 1) {
+		bit = fBitmap->FindZero(fBitmap->firstFreeWord * 64);
+		if (bit >= fBitmap->size)
+			return false;
+		// everything below is allocated
+		fBitmap->firstFreeWord = bit / 64;
+	} else if (!fBitmap->FindRun(size, align, bit))
+		return false;
+	if (!BitmapAllocAt(fBitmap->base + bit, size))
+		return false;
+	ptr = fBitmap->base + bit;
+	return true;
+}
+
+bool ExternalAllocator::BitmapAllocAt(uint64_t ptr, uint64_t size)
+{
+	BitmapIndex* bitmap = fBitmap;
+	if (size == 0 || ptr < bitmap->base || ptr - bitmap->base >= bitmap->size || size > bitmap->size - (ptr - bitmap->base))
+		return false;
+	uint64_t bit = ptr - bitmap->base;
+	if (!bitmap->Grow(bit + size) || bitmap->FindSet(bit, bit + size) != bit + size)
+		return false;
+	if (size > 1) {
+		Block *block = NewBlock(ptr, size);
+		if (block == NULL)
+			return false;
+		block->fAllocated = true;
+		fAdrMap.Insert(block);
+	}
+	bitmap->SetRange(bit, bit + size, true);
+	fAllocSize += size;
+	return true;
+}
+
+void ExternalAllocator::BitmapFree(uint64_t ptr)
+{
+	BitmapIndex* bitmap = fBitmap;
+	if (ptr < bitmap->base || ptr - bitmap->base >= bitmap->wordCount * 64) abort();
+	uint64_t bit = ptr - bitmap->base;
+	uint64_t size = 1;
+	Block *block = fAdrMap.FindClosest(ptr, true);
+	if (block != NULL && block->fAdr != ptr) {
+		// a unit inside a multi unit allocation
+		if (ptr - block->fAdr < block->fSize) abort();
+		block = NULL;
+	}
+	if (block != NULL) {
+		size = block->fSize;
+		fAdrMap.Remove(block);
+		DeleteBlock(block);
 	}
+	if (bitmap->FindZero(bit) < bit + size) abort();
+	bitmap->SetRange(bit, bit + size, false);
+	bitmap->firstFreeWord = std::min(bitmap->firstFreeWord, bit / 64);
+	fAllocSize -= size;
 }
@@ -69,17 +69,89 @@ private:
 		uint64 fAdr;
 		uint64 fSize;
 		AVLTreeNode fAdrNode;
-		AVLTreeNode fSizeNode;
+		union {
+			AVLTreeNode fSizeNode;
+			struct {
+				Block* prev;
+				Block* next;
+			} fFreeLink; // free list of a size class in kTlsf mode
+			Block* fNextUnused; // while in the block pool
+		};
 		bool fAllocated = false;
 
 		Block(uint64 adr, uint64 size): fAdr(adr), fSize(size) {}
 	};
 
+	// Two-level segregated fit index of the free blocks. The first level
+	// splits sizes by powers of two, the second level splits each of those
+	// linearly into kSlCount classes. A bitmap per level finds the first
+	// non-empty class that only holds blocks large enough in constant time.
+	struct TlsfIndex {
+		static const uint32_t kSlBits = 4;
+		static const uint32_t kSlCount = 1 << kSlBits;
+		static const uint32_t kFlCount = 64 - kSlBits + 1;
+
+		uint64_t flBitmap = 0;
+		uint32_t slBitmap[kFlCount] = {};
+		Block* lists[kFlCount][kSlCount] = {};
+
+		static void Mapping(uint64_t size, uint32_t &fl, uint32_t &sl);
+		void Insert(Block* block);
+		void Remove(Block* block);
+		Block* Find(uint64_t size);
+	};
+
+	// Bitmap of the units of a single registered range, a set bit is
+	// allocated. A summary bit per word is set when the word is full, so
+	// scans skip 64 full words at once. The words only cover the range up
+	// to the highest unit allocated so far. Multi unit allocations are
+	// recorded as blocks in fAdrMap to know their size on free.
+	struct BitmapIndex {
+		uint64_t base = 0, size = 0;
+		uint64_t* words = NULL;
+		uint64_t* summary = NULL;
+		uint64_t wordCount = 0; // a multiple of 64
+		uint64_t firstFreeWord = 0; // no free unit below this word
+
+		~BitmapIndex();
+
+		static uint64_t FindWordNot(const uint64_t* words, uint64_t from, uint64_t to, uint64_t value);
+		bool Grow(uint64_t bitCount);
+		uint64_t FindZero(uint64_t from);
+		uint64_t FindSet(uint64_t from, uint64_t to);
+		void SetRange(uint64_t from, uint64_t to, bool allocated);
+		bool FindRun(uint64_t count, uint64_t align, uint64_t &bit);
+	};
+
 	AVLTree<Block::AdrNodeDef> fAdrMap;
 	AVLTree<Block::SizeNodeDef> fSizeMap;
-	uint64_t fTotalSize, fAllocSize;
+	TlsfIndex* fTlsf = NULL;
+	BitmapIndex* fBitmap = NULL;
+	uint64_t fTotalSize = 0, fAllocSize = 0;
+	Block* fUnusedBlocks = NULL; // blocks are reused instead of deleted
+
+private:
+	Block* NewBlock(uint64_t adr, uint64_t size);
+	void DeleteBlock(Block* block);
+	void InsertFree(Block* block);
+	void RemoveFree(Block* block);
+	Block* FindFree(uint64_t size);
+	uint32_t FreeRun(const uint64_t* ptrs, uint32_t count);
+	bool BitmapAlloc(uint64_t &ptr, uint64_t size, uint64_t align);
+	bool BitmapAllocAt(uint64_t ptr, uint64_t size);
+	void BitmapFree(uint64_t ptr);
 
 public:
+	enum Mode {
+		kBestFit,	// smallest fitting free block, O(log n) in the free blocks
+		kTlsf,		// a fitting block of the next size class, found in O(1).
+					// Splits and frees still update the address tree, so
+					// they are O(log n) in all blocks.
+		kBitmap,	// lowest free units, for mostly single unit allocations
+					// from one registered range
+	};
+
+	ExternalAllocator(Mode mode = kBestFit);
 	~ExternalAllocator();
 
 	void Register(uint64_t ptr, uint64_t size);
@@ -89,6 +161,14 @@ public:
 	[[nodiscard]] bool AllocAt(uint64_t ptr, uint64_t size);
 	void Free(uint64_t ptr);
 
+	// Allocate count ranges of the same size, carved from as few free
+	// blocks as possible. Nothing is allocated on failure.
+	[[nodiscard]] bool AllocMany(uint64_t* ptrs, uint32_t count, uint64_t size);
+	// Free count ranges. Adjacent ranges are coalesced before their block
+	// is inserted into the size map, for that ptrs is sorted in place
+	// unless in kBitmap mode.
+	void FreeMany(uint64_t* ptrs, uint32_t count);
+
 	inline uint64_t TotalSize() {return fTotalSize;}
 	inline uint64_t AllocSize() {return fAllocSize;}
 };
@@ -3,15 +3,20 @@
 #pragma GCC diagnostic ignored "-Winvalid-offsetof"
 
 #include <fs_interface.h>
+#include <fs_query.h>
 #include <lock.h>
 #include <Referenceable.h>
 #include <AutoDeleter.h>
 #include <util/AVLTree.h>
 #include <util/DoublyLinkedList.h>
+#include <util/OpenHashTable.h>
+#include <slab/Slab.h>
 
 #include <string.h>
+#include <new>
 
 #include "ExternalAllocator.h"
+#include "ShmfsIoctl.h"
 
 #if 0
 #define TRACE(x...) dprintf(x)
@@ -26,23 +31,273 @@ class VMCache;
 class vm_page;
 
 class ShmfsVolume;
+class ShmfsNamePool;
 class ShmfsVnode;
 class ShmfsFileCookie;
 class ShmfsDirIterator;
 class ShmfsAttrDirIterator;
+struct ShmfsAttrCookie;
+class ShmfsVnodeReaper;
+struct ShmfsQuota;
+
+
+// Timestamps are stored as nanoseconds since the epoch, half the size of a
+// struct timespec.
+typedef int64 shmfs_time;
+
+shmfs_time GetCurrentTime();
+status_t ShmfsInitClock();
+void ShmfsUninitClock();
+
+// ioctl buffers may be in user or kernel space
+status_t CopyFromIoctlBuffer(void* dst, const void* src, size_t size);
+status_t CopyToIoctlBuffer(void* dst, const void* src, size_t size);
+status_t CopyStringFromIoctlBuffer(char* dst, const char* src, size_t size);
+// The same for pointers read from a buffer, user tells the address space of
+// the buffer instead of the pointer itself.
+status_t CopyFromIoctlBuffer(void* dst, const void* src, size_t size, bool user);
+status_t CopyToIoctlBuffer(void* dst, const void* src, size_t size, bool user);
+status_t CopyStringFromIoctlBuffer(char* dst, const char* src, size_t size, bool user);
+bool IsUserRange(const void* address, uint64 size);
+
+static inline shmfs_time ToShmfsTime(const struct timespec &time)
+{
+	return (shmfs_time)time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
+static inline struct timespec ToTimespec(shmfs_time time)
+{
+	time_t sec = time / 1000000000LL;
+	long nsec = time % 1000000000LL;
+	if (nsec < 0) {
+		sec--;
+		nsec += 1000000000LL;
+	}
+	return {.tv_sec = sec, .tv_nsec = nsec};
+}
+
+
+// Reference counted string shared by all users of the same name within a
+// volume. Equal pooled names have equal addresses.
+class ShmfsPooledName {
+private:
+	friend class ShmfsNamePool;
+
+	ShmfsPooledName* fHashLink;
+	ShmfsNamePool* fPool;
+	int32 fRefCount;
+	uint32 fHash;
+	char fName[];
 
+public:
+	inline const char* Name() {return fName;}
 
-void GetCurrentTime(struct timespec &outTime);
+	void AcquireReference();
+	void ReleaseReference();
+};
 
 
-class ShmfsAttribute: public BReferenceable {
+class ShmfsNamePool {
 private:
-	ArrayDeleter<char> fName;
+	friend class ShmfsPooledName;
+
+	struct HashDef {
+		typedef const char* KeyType;
+		typedef ShmfsPooledName ValueType;
+
+		inline size_t HashKey(KeyType key) const
+		{
+			return HashName(key);
+		}
+
+		inline size_t Hash(ValueType* value) const
+		{
+			return value->fHash;
+		}
+
+		inline bool Compare(KeyType key, ValueType* value) const
+		{
+			return strcmp(key, value->fName) == 0;
+		}
+
+		inline ValueType*& GetLink(ValueType* value) const
+		{
+			return value->fHashLink;
+		}
+	};
+
+	mutex fLock = MUTEX_INITIALIZER("shmfs name pool");
+	BOpenHashTable<HashDef> fNames;
+	bool fDiscarding = false; // see Discard()
+
+	void Release(ShmfsPooledName* name);
+
+public:
+	static uint32 HashName(const char* name);
+
+	~ShmfsNamePool();
+
+	status_t Init();
+	status_t Acquire(const char* name, ShmfsPooledName* &pooledName);
+	void Discard();
+};
+
+
+// Null-terminated string that is stored in place when it fits and is
+// interned in the volume name pool otherwise. The last inline byte tells both
+// cases apart, it is never covered by the pooled name pointer.
+template<size_t size>
+class ShmfsInlineString {
+private:
+	union {
+		char fInline[size];
+		ShmfsPooledName* fPooled;
+	};
+
+	static_assert(size > sizeof(ShmfsPooledName*));
+
+	inline bool IsPooled() const {return fInline[size - 1] != '\0';}
+
+public:
+	ShmfsInlineString()
+	{
+		fInline[0] = '\0';
+		fInline[size - 1] = '\0';
+	}
+
+	~ShmfsInlineString()
+	{
+		Unset();
+	}
+
+	inline const char* Get() const {return IsPooled() ? fPooled->Name() : fInline;}
+
+	status_t SetTo(ShmfsNamePool* pool, const char* str)
+	{
+		size_t len = strlen(str) + 1;
+		if (len < size) {
+			if (IsPooled()) {
+				ShmfsPooledName* oldPooled = fPooled;
+				memcpy(fInline, str, len);
+				fInline[size - 1] = '\0';
+				oldPooled->ReleaseReference();
+			} else
+				memmove(fInline, str, len);
+			return B_OK;
+		}
+		ShmfsPooledName* pooled;
+		CHECK_RET(pool->Acquire(str, pooled));
+		Unset();
+		fPooled = pooled;
+		fInline[size - 1] = 1;
+		return B_OK;
+	}
+
+	void Unset()
+	{
+		if (IsPooled())
+			fPooled->ReleaseReference();
+		fInline[0] = '\0';
+		fInline[size - 1] = '\0';
+	}
+};
+
+
+// Objects that are allocated and freed at high rate (vnodes, cookies,
+// iterators) are served from a dedicated slab object cache with per-CPU
+// magazines instead of the general kernel heap.
+template<typename Type>
+class ShmfsCachedObject {
+private:
+	static object_cache* sCache;
+
+public:
+	static status_t InitCache(const char* name)
+	{
+		sCache = create_object_cache(name, sizeof(Type), 0, NULL, NULL, NULL);
+		if (sCache == NULL)
+			return B_NO_MEMORY;
+		return B_OK;
+	}
+
+	static void UninitCache()
+	{
+		if (sCache != NULL) {
+			delete_object_cache(sCache);
+			sCache = NULL;
+		}
+	}
+
+	void* operator new(size_t size, const std::nothrow_t&) noexcept
+	{
+		return object_cache_alloc(sCache, 0);
+	}
+
+	void operator delete(void* object)
+	{
+		object_cache_free(sCache, object, 0);
+	}
+};
+
+template<typename Type>
+object_cache* ShmfsCachedObject<Type>::sCache = NULL;
+
+status_t ShmfsInitObjectCaches();
+void ShmfsUninitObjectCaches();
+
+extern fs_vnode_ops gShmfsVnodeOps;
+
+
+// Anonymous VM cache holding page granular data. Growing it adds pages
+// without copying the existing ones.
+class ShmfsPageCache {
+private:
+	VMCache* fCache{};
+
+private:
+	status_t GetPages(off_t offset, off_t length, bool isWrite, ShmfsVnode* owner, vm_page** pages);
+	void PutPages(off_t offset, off_t length, vm_page** pages, bool success);
+
+public:
+	~ShmfsPageCache();
+
+	status_t Init();
+	inline VMCache* Cache() {return fCache;}
+	status_t Resize(off_t size);
+	uint64 PageCount();
+	// missing pages written to are checked against the space of owner if set
+	status_t DoIO(const off_t offset, uint8* buffer, ssize_t length, size_t &bytesProcessed, bool isWrite, ShmfsVnode* owner);
+};
+
+
+class ShmfsAttribute: public BReferenceable, public ShmfsCachedObject<ShmfsAttribute> {
+public:
+	// larger values are moved from the heap to pages
+	static constexpr off_t kMaxHeapDataSize = B_PAGE_SIZE;
+
+private:
+	static const int32 kMaxOptimisticReads = 4;
+
+	// Heap buffer of a value. Replaced buffers are kept until the attribute
+	// is deleted, lock-free readers may still copy from them. With geometric
+	// growth they add up to less than twice the current one.
+	struct HeapData {
+		HeapData* retired;
+		uint8 data[];
+	};
+
+	ShmfsPooledName* fName{};
 public:
 	int32 fType = 0;
 private:
-	uint32 fDataSize = 0, fDataAllocSize = 0;
-	ArrayDeleter<uint8> fData;
+	mutex fLock = MUTEX_INITIALIZER("shmfs attribute"); // serializes writers
+	int32 fSeq = 0; // odd while the value changes, see Read()
+	off_t fDataSize = 0;
+	uint32 fDataAllocSize = 0;
+	HeapData* fData{};
+	ObjectDeleter<ShmfsPageCache> fPages;
+	ShmfsVnode* fOwner{}; // pages are charged to it, NULL once removed
+	int64 fChargedPages = 0;
 	AVLTreeNode fNameNode;
 
 	struct NameNodeDef {
@@ -61,12 +316,14 @@ private:
 
 		inline int Compare(const Key& a, const Value* b) const
 		{
-			return strcmp(a, &b->fName[0]);
+			return strcmp(a, b->fName->Name());
 		}
 
 		inline int Compare(const Value* a, const Value* b) const
 		{
-			return strcmp(&a->fName[0], &b->fName[0]);
+			if (a->fName == b->fName)
+				return 0;
+			return strcmp(a->fName->Name(), b->fName->Name());
 		}
 	};
 
@@ -74,11 +331,23 @@ public:
 	typedef AVLTree<NameNodeDef> NameMap;
 
 private:
-	status_t EnsureSize(uint32 size);
+	status_t EnsureSize(off_t size);
+	status_t MoveToPages();
+	status_t SetSize(off_t size);
+	status_t CopyOut(off_t pos, void* buffer, size_t &length);
+	void UpdateUsage();
+	inline void BeginChange() {atomic_add(&fSeq, 1);}
+	inline void EndChange() {atomic_add(&fSeq, 1);}
 
 public:
-	const char* Name() {return !fName.IsSet() ? "" : &fName[0];}
-	status_t SetName(const char* name);
+	~ShmfsAttribute();
+
+	const char* Name() {return fName == NULL ? "" : fName->Name();}
+	status_t SetName(ShmfsNamePool* pool, const char* name);
+	void SetName(ShmfsPooledName* name); // takes over the reference
+	status_t SetOwner(ShmfsVnode* owner);
+	inline int64 ChargedPages() {return fChargedPages;}
+	inline off_t Size() {return fDataSize;}
 
 	status_t Read(off_t pos, void* buffer, size_t &length);
 	status_t Write(off_t pos, const void* buffer, size_t &length);
@@ -87,8 +356,41 @@ public:
 };
 
 
-struct ShmfsAttrDirIterator {
+// Packed attribute in the small data area of a node, followed by the null
+// terminated name and the value. Records are 4 byte aligned.
+struct ShmfsSmallData {
+	uint32 type;
+	uint16 nameSize; // including the terminating null
+	uint16 dataSize;
+
+	inline char* Name() {return (char*)(this + 1);}
+	inline uint8* Data() {return (uint8*)(this + 1) + nameSize;}
+	inline uint32 RecordSize() {return RecordSize(nameSize, dataSize);}
+
+	static inline uint32 RecordSize(size_t nameSize, size_t dataSize)
+	{
+		return (uint32)((sizeof(ShmfsSmallData) + nameSize + dataSize + 3) & ~(size_t)3);
+	}
+};
+
+
+// Open attribute. Like in BFS the cookie only names the attribute, which can
+// move from the small data area to a separate object as it grows.
+struct ShmfsAttrCookie: public ShmfsCachedObject<ShmfsAttrCookie> {
+	ShmfsPooledName* name{};
+	int openMode = 0;
+
+	~ShmfsAttrCookie();
+	inline const char* Name() {return name->Name();}
+};
+
+
+// Small data records are visited first, then the separate attributes.
+struct ShmfsAttrDirIterator: public ShmfsCachedObject<ShmfsAttrDirIterator> {
 	DoublyLinkedListLink<ShmfsAttrDirIterator> link;
+	uint32 smallPos; // offset of the next small data record
+	bool inLarge;
+	bool registered = false; // in the iterators of the node's attributes
 	ShmfsAttribute* attr;
 
 	typedef DoublyLinkedList<
@@ -98,30 +400,78 @@ struct ShmfsAttrDirIterator {
 };
 
 
+// Attribute state is only allocated once a node gets its first attribute.
+// Values of up to kMaxSmallDataSize bytes are packed into one small data
+// buffer in insertion order, larger ones and those that don't fit into the
+// area get a ShmfsAttribute.
+struct ShmfsVnodeAttrs {
+	static const uint32 kMaxSmallDataSize = 128;
+	static const uint32 kMaxSmallDataAreaSize = 2048;
+
+	ShmfsAttribute::NameMap attrs;
+	ShmfsAttrDirIterator::List iterators;
+	ArrayDeleter<uint8> smallData;
+	uint32 smallDataSize = 0;
+	uint32 smallDataAllocSize = 0;
+
+	inline ShmfsSmallData* SmallDataAt(uint32 offset) {return (ShmfsSmallData*)&smallData[offset];}
+	ShmfsSmallData* FindSmallData(const char* name);
+	status_t AddSmallData(const char* name, uint32 type, const void* data, uint32 dataSize, ShmfsSmallData* &item);
+	status_t ResizeSmallData(ShmfsSmallData* &item, uint32 dataSize);
+	void RemoveSmallData(ShmfsSmallData* item);
+	status_t EnsureSmallDataSize(uint32 size);
+
+private:
+	void MoveSmallData(uint32 offset, int32 delta);
+};
+
+
 class ShmfsVnode: public BReferenceable {
+public:
+	enum Type: uint8 {
+		kFile,
+		kDirectory,
+		kSymlink,
+	};
+
 private:
 	friend class ShmfsVolume;
+	friend class ShmfsNotifier;
 
 	ShmfsVolume *fVolume{};
 	ino_t fId = 0;
-	ArrayDeleter<char> fName;
 	AVLTreeNode fIdNode;
+	bool fIdMapped = false; // in the volume id map, see ShmfsVolume::UnmapVnode()
 	AVLTreeNode fNameNode;
+	ShmfsInlineString<24> fName;
+
+	ObjectDeleter<ShmfsVnodeAttrs> fAttrs;
+
+	// queued stat changed notification, see ShmfsNotifier
+	ShmfsVnode *fNotifyNext{};
+	uint32 fPendingStatMask = 0;
 
-	ShmfsAttribute::NameMap fAttrs;
-	ShmfsAttrDirIterator::List fAttrIterators;
+	int32 fStatSeq = 0; // odd while stat fields change, see ReadStat()
+
+	// quota entries of the owner, resolved when the owner is set so charges
+	// don't need the volume lock
+	ShmfsQuota *fUserQuota{};
+	ShmfsQuota *fGroupQuota{};
 
 public:
 	ShmfsVnode *fParent{};
+	uint64 fDirPos = 0; // position in the parent directory, see ShmfsDirectoryVnode
 
 	// stat structure
 	uid_t fUid{};
 	gid_t fGid{};
 	mode_t fMode{};
-	struct timespec fAccessTime{};
-	struct timespec fModifyTime{};
-	struct timespec fChangeTime{};
-	struct timespec fCreateTime{};
+	const Type fType;
+	bool fFrozen = false; // see SHMFS_IOCTL_FREEZE
+	shmfs_time fAccessTime{};
+	shmfs_time fModifyTime{};
+	shmfs_time fChangeTime{};
+	shmfs_time fCreateTime{};
 
 private:
 	struct IdNodeDef {
@@ -150,7 +500,7 @@ private:
 	};
 
 	struct NameNodeDef {
-		typedef const char *Key;
+		typedef uint64 Key;
 		typedef ShmfsVnode Value;
 
 		inline AVLTreeNode* GetAVLTreeNode(Value* value) const
@@ -165,12 +515,12 @@ private:
 
 		inline int Compare(const Key& a, const Value* b) const
 		{
-			return strcmp(a, &b->fName[0]);
+			return (a < b->fDirPos) ? -1 : (a > b->fDirPos) ? 1 : 0;
 		}
 
 		inline int Compare(const Value* a, const Value* b) const
 		{
-			return strcmp(&a->fName[0], &b->fName[0]);
+			return (a->fDirPos < b->fDirPos) ? -1 : (a->fDirPos > b->fDirPos) ? 1 : 0;
 		}
 	};
 
@@ -179,24 +529,48 @@ public:
 	typedef AVLTree<NameNodeDef> NameMap;
 
 private:
+	bool RegisterAttrIterator(ShmfsAttrDirIterator* cookie);
 	void AttrIteratorRewind(ShmfsAttrDirIterator* cookie);
-	bool AttrIteratorGet(ShmfsAttrDirIterator* cookie, const char *&name, ShmfsAttribute *&attr);
+	bool AttrIteratorGet(ShmfsAttrDirIterator* cookie, const char *&name);
 	void AttrIteratorNext(ShmfsAttrDirIterator* cookie);
 	void RemoveAttr(ShmfsAttribute *attr);
+	status_t EnsureAttrs();
+	bool LookupAttr(const char* name, ShmfsSmallData* &small, ShmfsAttribute* &large);
+	status_t AddAttr(const char* name, uint32 type, const void* data, size_t size);
+	status_t ResizeAttr(ShmfsSmallData* &small, ShmfsAttribute* &large, off_t size);
+	status_t ReadAttrs(void* buffer, size_t bufferSize);
+	status_t WriteAttrs(const void* buffer);
+
+protected:
+	virtual void FillStat(struct stat &stat);
 
 public:
+	ShmfsVnode(Type type): fType(type) {}
 	virtual ~ShmfsVnode();
 
 	inline ino_t Id() {return fId;}
 	inline ShmfsVolume *Volume() {return fVolume;}
-	inline const char *Name() {return !fName.IsSet() ? "" : &fName[0];}
+	inline Type GetType() {return fType;}
+	inline bool IsDirectory() {return fType == kDirectory;}
+	bool IsFrozen();
+	inline mode_t TypeMode() {return fType == kDirectory ? S_IFDIR : fType == kSymlink ? S_IFLNK : S_IFREG;}
+	inline const char *Name() {return fName.Get();}
 	status_t SetName(const char *name);
+	void RemoveFromVfs();
+	bool TouchAccessTime();
+	bool ReadAttrValue(const char* name, uint32 &type, void* buffer, size_t &length);
+
+	// Bracket changes of the fields reported by ReadStat(). Writers hold the
+	// volume lock, so they never nest or overlap.
+	inline void BeginStatChange() {atomic_add(&fStatSeq, 1);}
+	inline void EndStatChange() {atomic_add(&fStatSeq, 1);}
+	virtual void GetUsage(shmfs_usage &usage);
 
 	virtual status_t Lookup(const char* name, ino_t &id);
 	status_t GetVnodeName(char* buffer, size_t bufferSize);
 	status_t PutVnode(bool reenter);
 	status_t RemoveVnode(bool reenter);
-	status_t Ioctl(ShmfsFileCookie* cookie, uint32 op, void* buffer, size_t length);
+	virtual status_t Ioctl(void* cookie, uint32 op, void* buffer, size_t length);
 	virtual status_t SetFlags(ShmfsFileCookie* cookie, int flags);
 	status_t Fsync();
 	virtual status_t ReadSymlink(char* buffer, size_t &bufferSize);
@@ -204,7 +578,7 @@ public:
 	virtual status_t Unlink(const char* name);
 	virtual status_t Rename(const char* fromName, ShmfsVnode* toDir, const char* toName);
 	status_t Access(int mode);
-	virtual status_t ReadStat(struct stat &stat);
+	status_t ReadStat(struct stat &stat);
 	virtual status_t WriteStat(const struct stat &stat, uint32 statMask);
 	virtual status_t Create(const char* name, int openMode, int perms, ShmfsFileCookie* &cookie, ino_t &newVnodeID);
 	virtual status_t Open(int openMode, ShmfsFileCookie* &cookie);
@@ -225,35 +599,46 @@ public:
 	status_t FreeAttrDirCookie(ShmfsAttrDirIterator* cookie);
 	status_t ReadAttrDir(ShmfsAttrDirIterator* cookie, struct dirent* buffer, size_t bufferSize, uint32 &num);
 	status_t RewindAttrDir(ShmfsAttrDirIterator* cookie);
-	status_t CreateAttr(const char* name, uint32 type, int openMode, ShmfsAttribute* &cookie);
-	status_t OpenAttr(const char* name, int openMode, ShmfsAttribute* &cookie);
-	status_t CloseAttr(ShmfsAttribute* cookie);
-	status_t FreeAttrCookie(ShmfsAttribute* cookie);
-	status_t ReadAttr(ShmfsAttribute* cookie, off_t pos, void* buffer, size_t &length);
-	status_t WriteAttr(ShmfsAttribute* cookie, off_t pos, const void* buffer, size_t &length);
-	status_t ReadAttrStat(ShmfsAttribute* cookie, struct stat &stat);
-	status_t WriteAttrStat(ShmfsAttribute* cookie, const struct stat &stat, int statMask);
+	status_t CreateAttr(const char* name, uint32 type, int openMode, ShmfsAttrCookie* &cookie);
+	status_t OpenAttr(const char* name, int openMode, ShmfsAttrCookie* &cookie);
+	status_t CloseAttr(ShmfsAttrCookie* cookie);
+	status_t FreeAttrCookie(ShmfsAttrCookie* cookie);
+	status_t ReadAttr(ShmfsAttrCookie* cookie, off_t pos, void* buffer, size_t &length);
+	status_t WriteAttr(ShmfsAttrCookie* cookie, off_t pos, const void* buffer, size_t &length);
+	status_t ReadAttrStat(ShmfsAttrCookie* cookie, struct stat &stat);
+	status_t WriteAttrStat(ShmfsAttrCookie* cookie, const struct stat &stat, int statMask);
 	status_t RenameAttr(const char* fromName, ShmfsVnode* toVnode, const char* toName);
 	status_t RemoveAttr(const char* name);
 };
 
-class ShmfsFileVnode: public ShmfsVnode {
+class ShmfsFileCookie: public ShmfsCachedObject<ShmfsFileCookie> {
+public:
+	bool isAppend = false;
+};
+
+class ShmfsFileVnode: public ShmfsVnode, public ShmfsCachedObject<ShmfsFileVnode> {
 private:
-	VMCache* fCache{};
+	ShmfsPageCache fCache;
 	uint64 fDataSize = 0;
+	// size and page count as last accounted in the parent directories
+	uint64 fUsedSize = 0;
+	uint64 fUsedPages = 0;
 
 private:
-	void _GetPages(off_t offset, off_t length, bool isWrite, vm_page** pages);
-	void _PutPages(off_t offset, off_t length, vm_page** pages, bool success);
-	status_t _DoCacheIO(const off_t offset, uint8* buffer, ssize_t length, size_t &bytesProcessed, bool isWrite);
+	void UpdateUsage();
 
 public:
+	ShmfsFileVnode(): ShmfsVnode(kFile) {}
 	~ShmfsFileVnode();
 
 	status_t Init();
+	status_t WriteInitialData(const void* buffer, size_t length);
 
+	inline uint64 DataSize() {return fDataSize;}
+	inline uint64 UsedPages() {return fUsedPages;}
+	void GetUsage(shmfs_usage &usage) final;
 	status_t SetFlags(ShmfsFileCookie* cookie, int flags) final;
-	status_t ReadStat(struct stat &stat) final;
+	void FillStat(struct stat &stat) final;
 	status_t WriteStat(const struct stat &stat, uint32 statMask) final;
 	status_t Open(int openMode, ShmfsFileCookie* &cookie) final;
 	status_t FreeCookie(ShmfsFileCookie* cookie) final;
@@ -262,37 +647,61 @@ public:
 };
 
 
-struct ShmfsDirIterator {
-	DoublyLinkedListLink<ShmfsDirIterator> link;
-	int32 idx;
-	ShmfsVnode* node;
-
-	typedef DoublyLinkedList<
-		ShmfsDirIterator,
-		DoublyLinkedListMemberGetLink<ShmfsDirIterator, &ShmfsDirIterator::link>
-	> List;
+struct ShmfsDirIterator: public ShmfsCachedObject<ShmfsDirIterator> {
+	uint64 pos; // next position to return
 };
 
 
-class ShmfsDirectoryVnode: public ShmfsVnode {
+// Directory entries are ordered by a stable 64 bit position derived from the
+// name hash, so iterators only need to remember the next position and are
+// not affected by removal of entries.
+//
+// Each directory keeps the usage totals of its subtree, linking and unlinking
+// an entry and changes of file sizes are propagated along the parent chain.
+class ShmfsDirectoryVnode: public ShmfsVnode, public ShmfsCachedObject<ShmfsDirectoryVnode> {
+public:
+	static constexpr uint64 kDirPosDot = 0;
+	static constexpr uint64 kDirPosDotDot = 1;
+	static constexpr uint64 kDirPosEnd = UINT64_MAX;
+
 private:
 	ShmfsVnode::NameMap fNodes;
-	ShmfsDirIterator::List fIterators;
-
-	void IteratorRewind(ShmfsDirIterator* cookie);
-	bool IteratorGet(ShmfsDirIterator* cookie, const char *&name, ShmfsVnode *&vnode);
-	void IteratorNext(ShmfsDirIterator* cookie);
-
+	shmfs_usage fUsage{0, 0, 1};
+	uint32 fFrozenCount = 0; // frozen subtrees below, they can't be removed
+
+	static inline uint64 HashDirPos(const char* name)
+	{
+		// positions of regular entries never collide with "." and ".."
+		return ((uint64)(ShmfsNamePool::HashName(name) >> 1) + 1) << 32;
+	}
+
+	ShmfsVnode* FindNode(const char* name);
+	void InsertNode(ShmfsVnode* vnode);
+	template<typename Emit>
+	status_t IterateEntries(ShmfsDirIterator* cookie, uint32 maxNum, uint32 &num, Emit emit);
+	status_t ReadDirStat(ShmfsDirIterator* cookie, void* buffer, size_t bufferSize);
+	status_t RemoveTree(const char* name);
+	status_t ResolvePath(char* path, ShmfsDirectoryVnode* &dir, const char* &name);
+	status_t CreateBatch(const void* buffer, size_t length);
+	status_t Freeze();
 	void InitTimestamps(ShmfsVnode* vnode);
 	void RemoveNode(ShmfsVnode *vnode);
+	status_t CreateNode(Type type, const char* name, int mode, const char* path, ShmfsVnode* &outVnode);
 
 public:
+	ShmfsDirectoryVnode(): ShmfsVnode(kDirectory) {}
 	~ShmfsDirectoryVnode();
 
+	static void ReapTree(ShmfsDirectoryVnode* dir, ShmfsVnodeReaper& reaper, bool removeFromVfs);
+	void UpdateUsage(int64 bytes, int64 pages, int64 nodes);
+	void AddFrozenCount(int32 count);
+	void GetUsage(shmfs_usage &usage) final;
+
+	status_t Ioctl(void* cookie, uint32 op, void* buffer, size_t length) final;
 	status_t CreateSymlink(const char* name, const char* path, int mode) final;
 	status_t Unlink(const char* name) final;
 	status_t Rename(const char* fromName, ShmfsVnode* toDir, const char* toName) final;
-	status_t ReadStat(struct stat &stat) final;
+	void FillStat(struct stat &stat) final;
 	status_t Create(const char* name, int openMode, int perms, ShmfsFileCookie* &cookie, ino_t &newVnodeID) final;
 	status_t CreateDir(const char* name, int perms) final;
 	status_t RemoveDir(const char* name) final;
@@ -305,47 +714,502 @@ public:
 };
 
 
-class ShmfsSymlinkVnode: public ShmfsVnode {
+class ShmfsSymlinkVnode: public ShmfsVnode, public ShmfsCachedObject<ShmfsSymlinkVnode> {
 private:
-	ArrayDeleter<char> fPath;
+	ShmfsInlineString<48> fPath;
 
 public:
+	ShmfsSymlinkVnode(): ShmfsVnode(kSymlink) {}
 	~ShmfsSymlinkVnode() = default;
 
-	const char* GetPath() {return !fPath.IsSet() ? "" : &fPath[0];}
+	const char* GetPath() {return fPath.Get();}
 	status_t SetPath(const char* path);
 
-	status_t ReadStat(struct stat &stat) final;
+	void FillStat(struct stat &stat) final;
 	status_t ReadSymlink(char* buffer, size_t &bufferSize) final;
 };
 
 
+// Drops vnode references in batches on a set of worker threads, so tearing
+// down large trees (destructors, page freeing) is spread across CPUs. Add()
+// may be called with the volume lock held, Flush() must not. Without a batch
+// buffer references are dropped right away in Add().
+class ShmfsVnodeReaper {
+private:
+	static const int32 kBatchSize = 4096;
+	static const int32 kMaxWorkers = 8;
+
+	ShmfsVnode** fBatch{};
+	int32 fCount = 0;
+	int32 fNext = 0;
+	bool fQuit = false;
+	bool fWorkersSpawned = false;
+	sem_id fStartSem = -1;
+	sem_id fDoneSem = -1;
+	int32 fWorkerCount = 0;
+	thread_id fWorkers[kMaxWorkers];
+
+	static status_t WorkerEntry(void* arg);
+	void SpawnWorkers();
+	void ReleaseBatchItems();
+
+public:
+	~ShmfsVnodeReaper();
+
+	status_t Init();
+	inline bool IsFull() {return fBatch != NULL && fCount >= kBatchSize;}
+	void Add(ShmfsVnode* vnode);
+	void Flush();
+};
+
+
+// Coalesces stat changed notifications of a volume. Changes of a node are
+// collected in its pending mask and sent as one notification by a volume
+// thread after a short window, so a burst of reads or writes costs one
+// node monitor call.
+class ShmfsNotifier {
+private:
+	static const bigtime_t kWindow = 10000;
+
+	ShmfsVolume* fVolume{};
+	ShmfsVnode* fPending{}; // linked through ShmfsVnode::fNotifyNext
+	sem_id fSem = -1;
+	thread_id fThread = -1;
+	bool fQuit = false;
+
+	static status_t ThreadEntry(void* arg);
+	void Flush();
+
+public:
+	~ShmfsNotifier();
+
+	status_t Init(ShmfsVolume* volume);
+	void StatChanged(ShmfsVnode* vnode, uint32 statMask); // volume lock held
+	void Shutdown();
+};
+
+
+// Counter for hot paths. Updates go to a per-CPU slot that is folded into
+// the global value once it exceeds kBatch, reading the exact value folds all
+// slots.
+class ShmfsCounter {
+private:
+	static const int64 kBatch = 64;
+	static const size_t kCacheLineSize = 64;
+
+	struct Slot {
+		int64 value;
+		uint8 padding[kCacheLineSize - sizeof(int64)]; // one slot per cache line
+	};
+
+	int64 fGlobal = 0;
+	ArrayDeleter<uint8> fSlotData;
+	Slot* fSlots{}; // cache line aligned within fSlotData
+	int32 fSlotCount = 0;
+
+public:
+	status_t Init();
+	void Add(int64 delta);
+	int64 Sum();
+	bool Fits(int64 delta, int64 limit);
+	bool TryAdd(int64 delta, int64 limit);
+};
+
+
+// Per-CPU magazines of single units in front of an ExternalAllocator. A
+// magazine is only touched by its own CPU with interrupts disabled, so Alloc()
+// and Free() take no lock unless the magazine runs empty or full. It is then
+// refilled or drained by kBatch units under fLock, which guards the allocator.
+// Cached units count as allocated in the allocator, so Alloc() may fail while
+// other CPUs still cache some. Meant for ranges much larger than the caches.
+class ShmfsUnitCache {
+private:
+	static const int32 kMagazineSize = 31;
+	static const int32 kBatch = 16;
+	static const size_t kCacheLineSize = 64;
+
+	struct Magazine {
+		uint64 count;
+		uint64 units[kMagazineSize]; // 256 bytes, a multiple of the cache line
+	};
+
+	mutex fLock = MUTEX_INITIALIZER("shmfs unit cache");
+	ExternalAllocator fAllocator;
+	ArrayDeleter<uint8> fMagazineData;
+	Magazine* fMagazines{}; // cache line aligned within fMagazineData
+	int32 fMagazineCount = 0;
+
+	bool Refill(uint64_t &unit);
+	void Drain(uint64_t unit);
+
+public:
+	ShmfsUnitCache(ExternalAllocator::Mode mode): fAllocator(mode) {}
+	~ShmfsUnitCache();
+
+	status_t Init();
+	void Register(uint64_t ptr, uint64_t size);
+
+	[[nodiscard]] bool Alloc(uint64_t &unit);
+	void Free(uint64_t unit);
+};
+
+
+// Usage and limits of one user or group. Entries are created when a node
+// gets the owner and live until unmount, nodes keep pointers to them.
+struct ShmfsQuota {
+	ShmfsQuota* hashLink;
+	uint64 key; // type << 32 | id
+	int64 maxPages = -1;
+	int64 maxNodes = -1;
+	ShmfsCounter usedPages;
+	ShmfsCounter usedNodes;
+
+	static inline uint64 MakeKey(uint32 type, uint32 id) {return (uint64)type << 32 | id;}
+};
+
+
+// Volume wide index over the name, size, last_modified or an attribute of
+// the nodes. Only linked nodes are indexed, size and last_modified only for
+// files and attribute indexes only for attributes of the index type. Entries
+// are ordered by key, then by node id. Called with the volume lock held.
+class ShmfsIndex {
+public:
+	static const size_t kMaxKeyLength = 256; // longer values are truncated
+
+	enum Kind: uint8 {
+		kName,
+		kSize,
+		kLastModified,
+		kAttribute,
+	};
+
+	struct Entry {
+		AVLTreeNode treeNode;
+		ShmfsVnode* vnode;
+		uint16 keyLength;
+		uint16 keyCapacity; // allocated key bytes, keys are rewritten in place
+		uint8 key[];
+	};
+
+private:
+	struct Key {
+		const void* data;
+		size_t length;
+		ino_t id;
+	};
+
+	struct EntryDef {
+		typedef ShmfsIndex::Key Key;
+		typedef Entry Value;
+
+		uint32 type;
+
+		EntryDef(uint32 type): type(type) {}
+
+		inline AVLTreeNode* GetAVLTreeNode(Value* value) const
+		{
+			return &value->treeNode;
+		}
+
+		inline Value* GetValue(AVLTreeNode* node) const
+		{
+			return (Value*)((char*)node - offsetof(Value, treeNode));
+		}
+
+		int Compare(const Key& a, const Value* b) const;
+		int Compare(const Value* a, const Value* b) const;
+	};
+
+public:
+	DoublyLinkedListLink<ShmfsIndex> link;
+
+	typedef DoublyLinkedList<
+		ShmfsIndex,
+		DoublyLinkedListMemberGetLink<ShmfsIndex, &ShmfsIndex::link>
+	> List;
+
+private:
+	char fName[B_ATTR_NAME_LENGTH];
+	uint32 fType;
+	Kind fKind;
+	AVLTree<EntryDef> fEntries;
+
+public:
+	ShmfsIndex(const char* name, uint32 type, Kind kind);
+	~ShmfsIndex();
+
+	inline const char* Name() {return fName;}
+	inline uint32 Type() {return fType;}
+	inline Kind GetKind() {return fKind;}
+	inline int32 Count() {return fEntries.Count();}
+
+	static bool IsStringType(uint32 type);
+	static bool IsSupportedType(uint32 type);
+	static int CompareKeys(uint32 type, const void* a, size_t aLength, const void* b, size_t bLength);
+	static bool ParseKey(uint32 type, const char* string, uint8* key, size_t &length);
+	static bool GetAttrKey(ShmfsVnode* vnode, const char* name, uint32 &type, uint8* key, size_t &length);
+
+	bool GetKey(ShmfsVnode* vnode, uint8* key, size_t &length);
+	status_t Insert(ShmfsVnode* vnode, const uint8* key, size_t length);
+	void Remove(ShmfsVnode* vnode, const uint8* key, size_t length);
+	status_t Update(ShmfsVnode* vnode, const uint8* oldKey, size_t oldLength, const uint8* key, size_t length);
+
+	Entry* First() {return fEntries.LeftMost();}
+	Entry* FindFirst(const uint8* key, size_t length); // first entry >= key
+	Entry* Next(Entry* entry) {return fEntries.Next(entry);}
+};
+
+
+// Brackets a change of the size and last_modified of a file (attr NULL) or
+// of one of its attributes. The old index keys and live query matches are
+// captured on construction, indexes are updated and live queries notified
+// on destruction. Used with the volume lock held, updates must not nest.
+class ShmfsIndexUpdate {
+private:
+	static const int32 kMaxInlineIndexes = 2;
+
+	struct OldKey {
+		ShmfsIndex* index;
+		bool indexed;
+		size_t length;
+		uint8 key[ShmfsIndex::kMaxKeyLength];
+	};
+
+	ShmfsVnode* fVnode;
+	status_t fInitStatus = B_OK;
+	int32 fCount = 0;
+	OldKey* fOld = fInlineOld;
+	OldKey fInlineOld[kMaxInlineIndexes];
+	ArrayDeleter<OldKey> fOldData;
+
+private:
+	void AddKey(ShmfsIndex* index);
+	void MatchQueries(const char* const* attrs, int32 count);
+
+public:
+	// vnode may be NULL if nothing indexed changes, attr NULL stands for size
+	// and last_modified
+	ShmfsIndexUpdate(ShmfsVnode* vnode, const char* attr);
+	// covers all attributes changed by a batch write
+	ShmfsIndexUpdate(ShmfsVnode* vnode, const char* const* attrs, int32 count);
+	~ShmfsIndexUpdate();
+
+	inline status_t InitCheck() {return fInitStatus;}
+};
+
+
+struct ShmfsIndexDirIterator {
+	int32 pos;
+};
+
+
+// Parsed query. Predicates compare name, size, last_modified or attributes
+// with a value, strings may use the *, ? and [...] wildcards with == and !=.
+// Matches are collected when the query is opened, live queries stay
+// registered with the volume and are notified about changes until closed.
+// Called with the volume lock held.
+class ShmfsQuery {
+private:
+	friend class ShmfsIndexUpdate;
+
+	static const int32 kMaxDepth = 16;
+	static const size_t kMaxQueryLength = 4096;
+
+	enum Op: uint8 {
+		kAnd,
+		kOr,
+		kNot,
+		kEqual,
+		kNotEqual,
+		kLess,
+		kLessEqual,
+		kGreater,
+		kGreaterEqual,
+	};
+
+	// && and || chains are kept as lists, so only parentheses nest
+	struct Term {
+		Op op;
+		bool hasWildcard = false;
+		Term* next{};     // in the list of the parent
+		Term* children{}; // kAnd, kOr, kNot
+		ShmfsIndex* property{}; // built-in index for name, size and last_modified
+		ArrayDeleter<char> attr, value;
+
+		~Term();
+	};
+
+	ShmfsVolume* fVolume;
+	ObjectDeleter<Term> fRoot;
+	uint32 fFlags;
+	port_id fPort;
+	uint32 fToken;
+
+	ArrayDeleter<ino_t> fResults;
+	uint32 fResultCount = 0;
+	uint32 fResultAlloc = 0;
+	uint32 fPos = 0;
+	uint32 fProperties = 0; // built-in indexes compared, 1 << ShmfsIndex::Kind
+	bool fAffected = false; // scratch for ShmfsIndexUpdate
+	bool fMatched = false;
+
+	status_t ParseList(const char* &str, int32 depth, Op op, ObjectDeleter<Term> &term);
+	status_t ParseUnary(const char* &str, int32 depth, ObjectDeleter<Term> &term);
+	status_t ParseComparison(const char* &str, ObjectDeleter<Term> &term);
+	static status_t ParseString(const char* &str, bool isValue, ArrayDeleter<char> &string);
+
+	bool Evaluate(Term* term, ShmfsVnode* vnode);
+	bool Compare(Term* term, ShmfsVnode* vnode);
+	bool References(Term* term, const char* attr);
+	Term* FindIndexedTerm(Term* term, ShmfsIndex* &index);
+	status_t AddResult(ino_t id);
+	status_t Collect();
+
+public:
+	DoublyLinkedListLink<ShmfsQuery> link;
+
+	typedef DoublyLinkedList<
+		ShmfsQuery,
+		DoublyLinkedListMemberGetLink<ShmfsQuery, &ShmfsQuery::link>
+	> List;
+
+	ShmfsQuery(ShmfsVolume* volume, uint32 flags, port_id port, uint32 token):
+		fVolume(volume), fFlags(flags), fPort(port), fToken(token) {}
+
+	static status_t Create(ShmfsVolume* volume, const char* query, uint32 flags, port_id port, uint32 token, ShmfsQuery* &outQuery);
+
+	inline bool IsLive() {return (fFlags & B_LIVE_QUERY) != 0;}
+	inline bool UsesProperty(ShmfsIndex::Kind kind) {return (fProperties & (1 << kind)) != 0;}
+	inline bool UsesAttr(const char* attr) {return References(fRoot.Get(), attr);}
+	bool Matches(ShmfsVnode* vnode);
+	void NotifyEntry(ShmfsVnode* vnode, bool created);
+	status_t Read(struct dirent* buffer, size_t bufferSize, uint32 &num);
+	inline void Rewind() {fPos = 0;}
+};
+
+
 class ShmfsVolume {
+public:
+	enum AtimeMode: uint8 {
+		kAtimeStrict,
+		kAtimeRelative,
+		kAtimeNone,
+	};
+
 private:
 	friend class ShmfsVnode;
+	friend class ShmfsIndexUpdate;
+	friend class ShmfsQuery;
+
+	struct QuotaHashDef {
+		typedef uint64 KeyType;
+		typedef ShmfsQuota ValueType;
+
+		inline size_t HashKey(KeyType key) const
+		{
+			return (size_t)(key ^ (key >> 32));
+		}
+
+		inline size_t Hash(ValueType* value) const
+		{
+			return HashKey(value->key);
+		}
+
+		inline bool Compare(KeyType key, ValueType* value) const
+		{
+			return key == value->key;
+		}
+
+		inline ValueType*& GetLink(ValueType* value) const
+		{
+			return value->hashLink;
+		}
+	};
 
 	recursive_lock fLock = RECURSIVE_LOCK_INITIALIZER("shmfs volume");
 
 	fs_volume *fBase{};
+	bool fUnmounting = false;
+
+	ShmfsNamePool fNamePool;
+	ShmfsNotifier fNotifier;
 
 	BReference<ShmfsVnode> fRootVnode;
 	ShmfsVnode::IdMap fIds;
-	ExternalAllocator fIdPool;
+	ShmfsUnitCache fIdPool{ExternalAllocator::kBitmap};
+
+	// capacity limits from the mount options, -1 if unlimited
+	int64 fMaxPages = -1;
+	int64 fMaxNodes = -1;
+	AtimeMode fAtimeMode = kAtimeRelative;
+	ShmfsCounter fUsedPages;
+	ShmfsCounter fUsedNodes;
+	BOpenHashTable<QuotaHashDef> fQuotas;
+
+	ShmfsIndex::List fIndexes;
+	ShmfsIndex* fNameIndex{};
+	ShmfsIndex* fSizeIndex{};
+	ShmfsIndex* fLastModifiedIndex{};
+	ShmfsQuery::List fLiveQueries;
+	int32 fAttrIndexCount = 0;
+	// held for reading by attribute writers that don't hold the volume lock,
+	// see AttrChangesObserved()
+	rw_lock fAttrWriterLock = RW_LOCK_INITIALIZER("shmfs attribute writers");
 
 	void ListVnodes();
+	status_t AddIndex(const char* name, uint32 type, ShmfsIndex::Kind kind, ShmfsIndex* &index);
+	status_t ParseOptions(const char* args);
+	ShmfsQuota* LookupQuota(uint32 type, uint32 id, bool create);
 
 public:
 	ShmfsVolume();
+	~ShmfsVolume();
 
 	inline recursive_lock *Lock() {return &fLock;}
+	inline rw_lock *AttrWriterLock() {return &fAttrWriterLock;}
+	// Whether attribute values must be changed with the volume lock held.
+	// Attribute writers are waited for when this becomes true.
+	inline bool AttrChangesObserved() {return fAttrIndexCount > 0 || !fLiveQueries.IsEmpty();}
+	inline ShmfsNamePool *NamePool() {return &fNamePool;}
+	inline ShmfsNotifier *Notifier() {return &fNotifier;}
 
 	inline fs_volume *Base() {return fBase;}
 	inline dev_t Id() {return fBase->id;}
 
+	inline bool IsUnmounting() {return fUnmounting;}
+	inline AtimeMode GetAtimeMode() {return fAtimeMode;}
+	status_t CheckSpace(ShmfsVnode *vnode, int64 pages, int64 nodes);
+	void AddUsage(ShmfsVnode *vnode, int64 pages, int64 nodes);
+	status_t LookupQuotas(uid_t uid, gid_t gid, ShmfsQuota* &userQuota, ShmfsQuota* &groupQuota);
+	status_t GetQuota(shmfs_quota &quota);
+	status_t SetQuota(shmfs_quota &quota);
+
 	status_t RegisterVnode(ShmfsVnode *vnode);
+	void UnmapVnode(ShmfsVnode *vnode);
+	status_t PublishVnode(ShmfsVnode *vnode);
+
+	ShmfsIndex* FindIndex(const char* name);
+	void WaitForAttrWriters();
+	inline ShmfsIndex* NameIndex() {return fNameIndex;}
+	void IndexLinked(ShmfsVnode *vnode);
+	void IndexUnlinked(ShmfsVnode *vnode);
 
 	static status_t Mount(ShmfsVolume* &volume, fs_volume *base, const char* device, uint32 flags, const char* args, ino_t &_rootVnodeID);
 	status_t Unmount();
 	status_t ReadFsInfo(struct fs_info &info);
 	status_t GetVnode(ino_t id, ShmfsVnode* &vnode, int &type, uint32 &flags, bool reenter);
+
+	status_t OpenIndexDir(ShmfsIndexDirIterator* &cookie);
+	status_t CloseIndexDir(ShmfsIndexDirIterator* cookie);
+	status_t FreeIndexDirCookie(ShmfsIndexDirIterator* cookie);
+	status_t ReadIndexDir(ShmfsIndexDirIterator* cookie, struct dirent* buffer, size_t bufferSize, uint32 &num);
+	status_t RewindIndexDir(ShmfsIndexDirIterator* cookie);
+	status_t CreateIndex(const char* name, uint32 type, uint32 flags);
+	status_t RemoveIndex(const char* name);
+	status_t ReadIndexStat(const char* name, struct stat &stat);
+	status_t OpenQuery(const char* query, uint32 flags, port_id port, uint32 token, ShmfsQuery* &cookie);
+	status_t CloseQuery(ShmfsQuery* cookie);
+	status_t FreeQueryCookie(ShmfsQuery* cookie);
+	status_t ReadQuery(ShmfsQuery* cookie, struct dirent* buffer, size_t bufferSize, uint32 &num);
+	status_t RewindQuery(ShmfsQuery* cookie);
 };
@@ -3,44 +3,180 @@
 #include <sys/stat.h>
 #include <NodeMonitor.h>
 
+#include <kernel.h>
+#include <cpu.h>
+#include <util/AutoLock.h>
+
 #include <algorithm>
+#include <stdlib.h>
+
+
+static const uint8 kZeroPage[B_PAGE_SIZE] = {};
 
 
-status_t ShmfsAttribute::EnsureSize(uint32 size)
+status_t ShmfsAttribute::EnsureSize(off_t size)
 {
+	if (size > kMaxHeapDataSize && !fPages.IsSet())
+		CHECK_RET(MoveToPages());
+	if (fPages.IsSet())
+		return fPages->Resize(std::max(size, fDataSize));
 	if (size > fDataAllocSize) {
-		uint32 newSize = size + size/2;
-		ArrayDeleter<uint8> newData(new(std::nothrow) uint8[newSize]);
-		if (!newData.IsSet())
+		uint32 newSize = (uint32)std::min<off_t>(size + size/2, kMaxHeapDataSize);
+		HeapData* newData = (HeapData*)malloc(sizeof(HeapData) + newSize);
+		if (newData == NULL)
 			return B_NO_MEMORY;
-		memcpy(&newData[0], &fData[0], fDataSize);
-		fData.SetTo(newData.Detach());
+		if (fDataSize > 0)
+			memcpy(newData->data, fData->data, fDataSize);
+		newData->retired = fData;
+		// publish the buffer before the size grows, see CopyOut()
+		memory_write_barrier();
+		fData = newData;
 		fDataAllocSize = newSize;
 	}
 	return B_OK;
 }
 
-
-status_t ShmfsAttribute::SetName(const char* name)
+// Copies the value to pages once, further growth doesn't copy. The heap
+// buffer is kept for readers.
+status_t ShmfsAttribute::MoveToPages()
 {
-	size_t len = strlen(name) + 1;
-	ArrayDeleter<char> newName(new(std::nothrow) char[len]);
-	if (!newName.IsSet())
+	ObjectDeleter<ShmfsPageCache> pages(new(std::nothrow) ShmfsPageCache());
+	if (!pages.IsSet())
 		return B_NO_MEMORY;
-	memcpy(&newName[0], name, len);
-	fName.SetTo(newName.Detach());
+	CHECK_RET(pages->Init());
+	if (fDataSize > 0) {
+		CHECK_RET(pages->Resize(fDataSize));
+		size_t written;
+		CHECK_RET(pages->DoIO(0, fData->data, fDataSize, written, true, fOwner));
+	}
+	memory_write_barrier();
+	fPages.SetTo(pages.Detach());
+	return B_OK;
+}
+
+// Called with fLock held inside a change.
+status_t ShmfsAttribute::SetSize(off_t size)
+{
+	if (size < 0)
+		return B_BAD_VALUE;
+	CHECK_RET(EnsureSize(size));
+	if (fPages.IsSet()) {
+		// pages past the size are freed, but the rest of the last page
+		// must read as zeros when growing again
+		off_t end = std::min<off_t>(fDataSize, ROUNDUP(size, B_PAGE_SIZE));
+		if (size < end) {
+			size_t written;
+			CHECK_RET(fPages->DoIO(size, (uint8*)kZeroPage, end - size, written, true, fOwner));
+		}
+		fDataSize = size;
+		return fPages->Resize(fDataSize);
+	}
+	if (size > fDataSize)
+		memset(&fData->data[fDataSize], 0, size - fDataSize);
+	memory_write_barrier();
+	fDataSize = size;
+	return B_OK;
+}
+
+// Copies from the value without synchronization, Read() validates the copy.
+// The size is read first, the buffers are published before it grows.
+status_t ShmfsAttribute::CopyOut(off_t pos, void* buffer, size_t &length)
+{
+	off_t size = fDataSize;
+	memory_read_barrier();
+	pos = std::min<off_t>(pos, size);
+	length = (size_t)std::min<off_t>(length, size - pos);
+	if (length == 0)
+		return B_OK;
+	ShmfsPageCache* pages = fPages.Get();
+	if (pages != NULL)
+		return pages->DoIO(pos, (uint8*)buffer, length, length, false, NULL);
+	return CopyToIoctlBuffer(buffer, &fData->data[pos], length);
+}
+
+// Charges pages added or freed by a change to the owner. Called with fLock
+// held.
+void ShmfsAttribute::UpdateUsage()
+{
+	int64 pageCount = fPages.IsSet() ? (int64)fPages->PageCount() : 0;
+	if (fOwner != NULL)
+		fOwner->Volume()->AddUsage(fOwner, pageCount - fChargedPages, 0);
+	fChargedPages = pageCount;
+}
+
+
+ShmfsAttribute::~ShmfsAttribute()
+{
+	// attributes that never made it into a node are still charged
+	SetOwner(NULL);
+	if (fName != NULL)
+		fName->ReleaseReference();
+	while (fData != NULL) {
+		HeapData* retired = fData->retired;
+		free(fData);
+		fData = retired;
+	}
+	mutex_destroy(&fLock);
+}
+
+status_t ShmfsAttribute::SetName(ShmfsNamePool* pool, const char* name)
+{
+	ShmfsPooledName* newName;
+	CHECK_RET(pool->Acquire(name, newName));
+	SetName(newName);
 	return B_OK;
 }
 
+void ShmfsAttribute::SetName(ShmfsPooledName* name)
+{
+	if (fName != NULL)
+		fName->ReleaseReference();
+	fName = name;
+}
 
+// Moves the charges of the pages to owner, set before the first write. A
+// removed attribute has no owner and can't grow anymore, writers that looked
+// it up before may still hold it. Called with the volume lock held.
+status_t ShmfsAttribute::SetOwner(ShmfsVnode* owner)
+{
+	MutexLocker locker(fLock);
+	if (fOwner != NULL && !fOwner->Volume()->IsUnmounting())
+		fOwner->Volume()->AddUsage(fOwner, -fChargedPages, 0);
+	if (owner != NULL) {
+		status_t res = owner->Volume()->CheckSpace(owner, fChargedPages, 0);
+		if (res < B_OK) {
+			if (fOwner != NULL && !fOwner->Volume()->IsUnmounting())
+				fOwner->Volume()->AddUsage(fOwner, fChargedPages, 0);
+			return res;
+		}
+		owner->Volume()->AddUsage(owner, fChargedPages, 0);
+	}
+	fOwner = owner;
+	return B_OK;
+}
+
+
+// Readers don't lock: the copy is retried if a writer changed the value
+// meanwhile, after a few attempts they wait for the writer instead.
 status_t ShmfsAttribute::Read(off_t pos, void* buffer, size_t &length)
 {
 	if (pos < 0)
 		return B_BAD_VALUE;
-	pos = std::min<off_t>(pos, fDataSize);
-	length = std::min<size_t>(length, size_t(fDataSize - pos));
-	memcpy(buffer, &fData[pos], length);
-	return B_OK;
+	const size_t bufferSize = length;
+	for (int32 attempt = 0; attempt < kMaxOptimisticReads; attempt++) {
+		int32 seq = atomic_get(&fSeq);
+		if ((seq & 1) == 0) {
+			length = bufferSize;
+			status_t res = CopyOut(pos, buffer, length);
+			memory_read_barrier();
+			if (atomic_get(&fSeq) == seq)
+				return res;
+		}
+		cpu_pause();
+	}
+	MutexLocker locker(fLock);
+	length = bufferSize;
+	return CopyOut(pos, buffer, length);
 }
 
 status_t ShmfsAttribute::Write(off_t pos, const void* buffer, size_t &length)
@@ -52,10 +188,22 @@ status_t ShmfsAttribute::Write(off_t pos, const void* buffer, size_t &length)
 		length = 0;
 		return B_OK;
 	}
+	MutexLocker locker(fLock);
+	if (fOwner == NULL)
+		return B_ENTRY_NOT_FOUND;
+	BeginChange();
+	status_t res = B_OK;
 	if (newSize > fDataSize)
-		CHECK_RET(WriteStat({.st_size = newSize}, B_STAT_SIZE));
-	memcpy(&fData[pos], buffer, length);
-	return B_OK;
+		res = SetSize(newSize);
+	if (res == B_OK && length > 0) {
+		if (fPages.IsSet())
+			res = fPages->DoIO(pos, (uint8*)buffer, length, length, true, fOwner);
+		else
+			res = CopyFromIoctlBuffer(&fData->data[pos], buffer, length);
+	}
+	EndChange();
+	UpdateUsage();
+	return res;
 }
 
 status_t ShmfsAttribute::ReadStat(struct stat &stat)
@@ -68,11 +216,114 @@ status_t ShmfsAttribute::ReadStat(struct stat &stat)
 
 status_t ShmfsAttribute::WriteStat(const struct stat &stat, int statMask)
 {
-	if ((statMask & B_STAT_SIZE) != 0) {
-		CHECK_RET(EnsureSize(stat.st_size));
-		if (stat.st_size > fDataSize)
-			memset(&fData[fDataSize], 0, stat.st_size - fDataSize);
-		fDataSize = stat.st_size;
+	if ((statMask & B_STAT_SIZE) == 0)
+		return B_OK;
+	MutexLocker locker(fLock);
+	if (fOwner == NULL)
+		return B_ENTRY_NOT_FOUND;
+	BeginChange();
+	status_t res = SetSize(stat.st_size);
+	EndChange();
+	UpdateUsage();
+	return res;
+}
+
+
+//#pragma mark - ShmfsAttrCookie
+
+ShmfsAttrCookie::~ShmfsAttrCookie()
+{
+	if (name != NULL)
+		name->ReleaseReference();
+}
+
+
+//#pragma mark - ShmfsVnodeAttrs
+
+status_t ShmfsVnodeAttrs::EnsureSmallDataSize(uint32 size)
+{
+	if (size > kMaxSmallDataAreaSize)
+		return B_DEVICE_FULL;
+	if (size > smallDataAllocSize) {
+		uint32 newSize = std::min(std::max<uint32>(size + size/2, 64), kMaxSmallDataAreaSize);
+		ArrayDeleter<uint8> newData(new(std::nothrow) uint8[newSize]);
+		if (!newData.IsSet())
+			return B_NO_MEMORY;
+		if (smallDataSize > 0)
+			memcpy(&newData[0], &smallData[0], smallDataSize);
+		smallData.SetTo(newData.Detach());
+		smallDataAllocSize = newSize;
 	}
 	return B_OK;
 }
+
+// Moves the records from offset on by delta bytes, iterators follow them.
+void ShmfsVnodeAttrs::MoveSmallData(uint32 offset, int32 delta)
+{
+	memmove(&smallData[offset + delta], &smallData[offset], smallDataSize - offset);
+	smallDataSize += delta;
+	for (ShmfsAttrDirIterator *it = iterators.First(); it != NULL; it = iterators.GetNext(it)) {
+		if (!it->inLarge && it->smallPos >= offset)
+			it->smallPos += delta;
+	}
+}
+
+ShmfsSmallData* ShmfsVnodeAttrs::FindSmallData(const char* name)
+{
+	for (uint32 offset = 0; offset < smallDataSize;) {
+		ShmfsSmallData* item = SmallDataAt(offset);
+		if (strcmp(item->Name(), name) == 0)
+			return item;
+		offset += item->RecordSize();
+	}
+	return NULL;
+}
+
+// Appends a record, fails with B_DEVICE_FULL if the value is too large or
+// the area has no room.
+status_t ShmfsVnodeAttrs::AddSmallData(const char* name, uint32 type, const void* data, uint32 dataSize, ShmfsSmallData* &item)
+{
+	if (dataSize > kMaxSmallDataSize)
+		return B_DEVICE_FULL;
+	size_t nameSize = strlen(name) + 1;
+	uint32 recordSize = ShmfsSmallData::RecordSize(nameSize, dataSize);
+	CHECK_RET(EnsureSmallDataSize(smallDataSize + recordSize));
+	item = SmallDataAt(smallDataSize);
+	item->type = type;
+	item->nameSize = (uint16)nameSize;
+	item->dataSize = (uint16)dataSize;
+	memcpy(item->Name(), name, nameSize);
+	if (dataSize > 0)
+		memcpy(item->Data(), data, dataSize);
+	smallDataSize += recordSize;
+	return B_OK;
+}
+
+// Resizes the value of a record in place, new bytes are zeroed. The area may
+// be reallocated, item is updated. Fails with B_DEVICE_FULL like
+// AddSmallData().
+status_t ShmfsVnodeAttrs::ResizeSmallData(ShmfsSmallData* &item, uint32 dataSize)
+{
+	if (dataSize > kMaxSmallDataSize)
+		return B_DEVICE_FULL;
+	uint32 offset = (uint8*)item - &smallData[0];
+	uint32 oldRecordSize = item->RecordSize();
+	int32 delta = (int32)ShmfsSmallData::RecordSize(item->nameSize, dataSize) - (int32)oldRecordSize;
+	if (delta > 0) {
+		CHECK_RET(EnsureSmallDataSize(smallDataSize + delta));
+		item = SmallDataAt(offset);
+	}
+	if (delta != 0)
+		MoveSmallData(offset + oldRecordSize, delta);
+	if (dataSize > item->dataSize)
+		memset(item->Data() + item->dataSize, 0, dataSize - item->dataSize);
+	item->dataSize = (uint16)dataSize;
+	return B_OK;
+}
+
+void ShmfsVnodeAttrs::RemoveSmallData(ShmfsSmallData* item)
+{
+	uint32 offset = (uint8*)item - &smallData[0];
+	uint32 recordSize = item->RecordSize();
+	MoveSmallData(offset + recordSize, -(int32)recordSize);
+}
@@ -0,0 +1,56 @@
+#include "Shmfs.h"
+
+#include <KernelExport.h>
+#include <kernel.h>
+#include <smp.h>
+
+
+status_t ShmfsCounter::Init()
+{
+	fSlotCount = smp_get_num_cpus();
+	// new[] only aligns to 8 bytes
+	fSlotData.SetTo(new(std::nothrow) uint8[fSlotCount * sizeof(Slot) + kCacheLineSize - 1]);
+	if (!fSlotData.IsSet())
+		return B_NO_MEMORY;
+	fSlots = (Slot*)ROUNDUP((addr_t)&fSlotData[0], kCacheLineSize);
+	for (int32 i = 0; i < fSlotCount; i++)
+		fSlots[i].value = 0;
+	return B_OK;
+}
+
+void ShmfsCounter::Add(int64 delta)
+{
+	// A thread that migrates meanwhile updates another CPU's slot, that is
+	// only slower, not wrong.
+	Slot &slot = fSlots[smp_get_current_cpu() % fSlotCount];
+	int64 value = atomic_add64(&slot.value, delta) + delta;
+	if (value > kBatch || value < -kBatch)
+		atomic_add64(&fGlobal, atomic_get_and_set64(&slot.value, 0));
+}
+
+int64 ShmfsCounter::Sum()
+{
+	int64 sum = atomic_get64(&fGlobal);
+	for (int32 i = 0; i < fSlotCount; i++)
+		sum += atomic_get64(&fSlots[i].value);
+	return sum;
+}
+
+// Tells whether delta can be added without exceeding limit, a negative limit
+// means no limit. The slots are only folded close to the limit.
+bool ShmfsCounter::Fits(int64 delta, int64 limit)
+{
+	if (limit < 0 || delta <= 0)
+		return true;
+	if (atomic_get64(&fGlobal) + delta + fSlotCount * kBatch <= limit)
+		return true;
+	return Sum() + delta <= limit;
+}
+
+bool ShmfsCounter::TryAdd(int64 delta, int64 limit)
+{
+	if (!Fits(delta, limit))
+		return false;
+	Add(delta);
+	return true;
+}
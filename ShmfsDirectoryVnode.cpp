@@ -3,11 +3,16 @@
 #include <KernelExport.h>
 #include <NodeMonitor.h>
 #include <dirent.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <kernel.h>
+#include <arch/atomic.h>
 #include <util/AutoLock.h>
 
 #include <new>
 #include <algorithm>
+#include <stdint.h>
 
 
 ShmfsDirectoryVnode::~ShmfsDirectoryVnode()
@@ -22,80 +27,579 @@ ShmfsDirectoryVnode::~ShmfsDirectoryVnode()
 }
 
 
-void ShmfsDirectoryVnode::IteratorRewind(ShmfsDirIterator* cookie)
+ShmfsVnode* ShmfsDirectoryVnode::FindNode(const char* name)
 {
-	cookie->idx = 0;
-	cookie->node = fNodes.LeftMost();
-}
-
-bool ShmfsDirectoryVnode::IteratorGet(ShmfsDirIterator* cookie, const char *&name, ShmfsVnode *&vnode)
-{
-	switch (cookie->idx) {
-		case 0:
-			name = ".";
-			vnode = this;
-			return true;
-		case 1:
-			if (fParent == NULL) {
-				cookie->idx++;
-				return IteratorGet(cookie, name, vnode);
-			} else {
-				name = "..";
-				vnode = fParent;
-				return true;
-			}
-		case 2:
-			if (cookie->node == NULL)
-				return false;
-			vnode = cookie->node;
-			name = vnode->Name();
-			return true;
+	uint64 pos = HashDirPos(name);
+	for (ShmfsVnode *vnode = fNodes.FindClosest(pos, false); vnode != NULL && (vnode->fDirPos >> 32) == (pos >> 32); vnode = fNodes.Next(vnode)) {
+		if (strcmp(vnode->Name(), name) == 0)
+			return vnode;
 	}
-	return false;
+	return NULL;
 }
 
-void ShmfsDirectoryVnode::IteratorNext(ShmfsDirIterator* cookie)
+void ShmfsDirectoryVnode::InsertNode(ShmfsVnode* vnode)
 {
-	switch (cookie->idx) {
-		case 0:
-			cookie->idx++;
-			if (fParent == NULL)
-				cookie->idx++;
-			break;
-		case 1:
-			cookie->idx++;
-			break;
-		case 2:
-			cookie->node = fNodes.Next(cookie->node);
-			break;
-	}
+	// take the first free collision index for the name hash
+	uint64 pos = HashDirPos(vnode->Name());
+	for (ShmfsVnode *other = fNodes.FindClosest(pos, false); other != NULL && other->fDirPos == pos; other = fNodes.Next(other))
+		pos++;
+	vnode->fDirPos = pos;
+	vnode->fParent = this;
+	fNodes.Insert(vnode);
+	Volume()->IndexLinked(vnode);
+
+	shmfs_usage usage;
+	vnode->GetUsage(usage);
+	UpdateUsage(usage.bytes, usage.pages, usage.nodes);
+	if (vnode->IsDirectory())
+		AddFrozenCount(static_cast<ShmfsDirectoryVnode*>(vnode)->fFrozenCount);
 }
 
 void ShmfsDirectoryVnode::InitTimestamps(ShmfsVnode *vnode)
 {
-	struct timespec time;
-	GetCurrentTime(time);
+	shmfs_time time = GetCurrentTime();
 	vnode->fAccessTime = time;
 	vnode->fModifyTime = time;
 	vnode->fChangeTime = time;
 	vnode->fCreateTime = time;
 
+	BeginStatChange();
 	fModifyTime = time;
 	fChangeTime = time;
+	EndStatChange();
 }
 
 void ShmfsDirectoryVnode::RemoveNode(ShmfsVnode *vnode)
 {
-	for (ShmfsDirIterator *it = fIterators.First(); it != NULL; it = fIterators.GetNext(it)) {
-		if (it->node == vnode)
-			IteratorNext(it);
-	}
+	Volume()->IndexUnlinked(vnode);
 	fNodes.Remove(vnode);
+	vnode->fParent = NULL;
+
+	shmfs_usage usage;
+	vnode->GetUsage(usage);
+	UpdateUsage(-(int64)usage.bytes, -(int64)usage.pages, -(int64)usage.nodes);
+	if (vnode->IsDirectory())
+		AddFrozenCount(-(int32)static_cast<ShmfsDirectoryVnode*>(vnode)->fFrozenCount);
+}
+
+void ShmfsDirectoryVnode::AddFrozenCount(int32 count)
+{
+	if (count == 0)
+		return;
+	for (ShmfsVnode *vnode = this; vnode != NULL; vnode = vnode->fParent)
+		static_cast<ShmfsDirectoryVnode*>(vnode)->fFrozenCount += count;
+}
+
+// Adds to the usage totals of this directory and all its ancestors. Called
+// with the volume lock held.
+void ShmfsDirectoryVnode::UpdateUsage(int64 bytes, int64 pages, int64 nodes)
+{
+	for (ShmfsVnode *vnode = this; vnode != NULL; vnode = vnode->fParent) {
+		shmfs_usage &usage = static_cast<ShmfsDirectoryVnode*>(vnode)->fUsage;
+		vnode->BeginStatChange();
+		usage.bytes += bytes;
+		usage.pages += pages;
+		usage.nodes += nodes;
+		vnode->EndStatChange();
+	}
+}
+
+void ShmfsDirectoryVnode::GetUsage(shmfs_usage &usage)
+{
+	usage = fUsage;
+}
+
+// Allocates, registers and links a new node. Called with the volume lock held
+// after the caller checked that the name is free. The returned node is owned
+// by the directory, new files are additionally acquired by the VFS.
+status_t ShmfsDirectoryVnode::CreateNode(Type type, const char* name, int mode, const char* path, ShmfsVnode* &outVnode)
+{
+	if (IsFrozen())
+		return B_NOT_ALLOWED;
+
+	BReference<ShmfsVnode> vnode;
+	switch (type) {
+		case kFile:
+			vnode.SetTo(new(std::nothrow) ShmfsFileVnode(), true);
+			break;
+		case kDirectory:
+			vnode.SetTo(new(std::nothrow) ShmfsDirectoryVnode(), true);
+			break;
+		case kSymlink:
+			vnode.SetTo(new(std::nothrow) ShmfsSymlinkVnode(), true);
+			break;
+	}
+	if (!vnode.IsSet())
+		return B_NO_MEMORY;
+
+	CHECK_RET(Volume()->RegisterVnode(vnode));
+	CHECK_RET(vnode->SetName(name));
+	if (type == kSymlink)
+		CHECK_RET(static_cast<ShmfsSymlinkVnode*>(vnode.Get())->SetPath(path));
+	vnode->fMode = mode & S_IUMSK;
+	if (type == kFile) {
+		CHECK_RET(Volume()->PublishVnode(vnode));
+		status_t res = static_cast<ShmfsFileVnode*>(vnode.Get())->Init();
+		if (res < B_OK) {
+			put_vnode(Volume()->Base(), vnode->Id());
+			vnode.Detach();
+			return res;
+		}
+	}
+	InitTimestamps(vnode.Get());
+	InsertNode(vnode);
+	outVnode = vnode.Detach();
+	return B_OK;
+}
+
+
+// Calls emit(name, vnode) for the entries starting at the cookie position
+// until maxNum entries were emitted or emit() returns false because the entry
+// does not fit. The cookie is advanced past the emitted entries.
+template<typename Emit>
+status_t ShmfsDirectoryVnode::IterateEntries(ShmfsDirIterator* cookie, uint32 maxNum, uint32 &num, Emit emit)
+{
+	num = 0;
+
+	// the root directory has no ".."
+	if (cookie->pos == kDirPosDotDot && fParent == NULL)
+		cookie->pos++;
+
+	// look up the position once, then walk the tree
+	ShmfsVnode *vnode = NULL;
+	if (cookie->pos > kDirPosDotDot && cookie->pos != kDirPosEnd)
+		vnode = fNodes.FindClosest(cookie->pos, false);
+
+	while (num < maxNum) {
+		bool fits;
+		if (cookie->pos == kDirPosDot)
+			fits = emit(".", this);
+		else if (cookie->pos == kDirPosDotDot)
+			fits = emit("..", fParent);
+		else if (vnode != NULL)
+			fits = emit(vnode->Name(), vnode);
+		else
+			break;
+
+		if (!fits) {
+			if (num == 0)
+				return B_BUFFER_OVERFLOW;
+			break;
+		}
+		num++;
+
+		if (cookie->pos == kDirPosDot && fParent != NULL) {
+			cookie->pos = kDirPosDotDot;
+			continue;
+		}
+		vnode = cookie->pos <= kDirPosDotDot ? fNodes.LeftMost() : fNodes.Next(vnode);
+		cookie->pos = vnode == NULL ? kDirPosEnd : vnode->fDirPos;
+	}
+
+	return B_OK;
+}
+
+status_t ShmfsDirectoryVnode::ReadDirStat(ShmfsDirIterator* cookie, void* buffer, size_t bufferSize)
+{
+	// entries are collected in a kernel buffer so no user memory is touched
+	// with the volume lock held
+	const size_t kMaxBufferSize = 256 * 1024;
+	if (bufferSize < sizeof(shmfs_dir_stat_buffer))
+		return B_BAD_VALUE;
+	bufferSize = std::min(bufferSize, kMaxBufferSize);
+	ArrayDeleter<uint8> data(new(std::nothrow) uint8[bufferSize]);
+	if (!data.IsSet())
+		return B_NO_MEMORY;
+
+	shmfs_dir_stat_buffer* header = (shmfs_dir_stat_buffer*)&data[0];
+	size_t offset = sizeof(shmfs_dir_stat_buffer);
+	uint32 num;
+	status_t res;
+	status_t statRes = B_OK;
+	{
+		RecursiveLocker lock(Volume()->Lock(), false, !IsFrozen());
+		res = IterateEntries(cookie, UINT32_MAX, num, [&](const char* name, ShmfsVnode* vnode) {
+			size_t nameLen = strlen(name) + 1;
+			size_t recordSize = ROUNDUP(offsetof(shmfs_dir_stat_entry, name) + nameLen, 8);
+			if (bufferSize - offset < recordSize)
+				return false;
+			shmfs_dir_stat_entry* entry = (shmfs_dir_stat_entry*)&data[offset];
+			statRes = vnode->ReadStat(entry->stat);
+			if (statRes < B_OK)
+				return false;
+			entry->stat.st_dev = Volume()->Id();
+			entry->reclen = (uint16)recordSize;
+			memcpy(entry->name, name, nameLen);
+			offset += recordSize;
+			return true;
+		});
+	}
+	// The cookie is not advanced past an entry that failed. Entries collected
+	// before it are returned, the error is reported by the next call.
+	if (num == 0) {
+		CHECK_RET(statRes);
+		CHECK_RET(res);
+	}
+	header->count = num;
+	header->reserved = 0;
+
+	return CopyToIoctlBuffer(buffer, &data[0], offset);
+}
+
+// Releases a detached directory and everything below it. The caller's
+// reference to dir is consumed.
+//
+// Depth first without recursion: fParent of a detached directory links back
+// to the directory to continue with once it is empty. Nodes are handed to the
+// reaper after their children, in batches so the volume lock is not held for
+// the whole tree. Usage totals of the dying tree are not maintained, the
+// nodes are removed from the indexes unless the volume is unmounting. They
+// also leave the id map here, so the reaper workers don't need the volume
+// lock to destroy them.
+void ShmfsDirectoryVnode::ReapTree(ShmfsDirectoryVnode* dir, ShmfsVnodeReaper& reaper, bool removeFromVfs)
+{
+	ShmfsVolume *volume = dir->Volume();
+	ShmfsDirectoryVnode *stackTop = dir;
+	while (stackTop != NULL) {
+		{
+			RecursiveLocker lock(volume->Lock());
+			while (stackTop != NULL && !reaper.IsFull()) {
+				ShmfsVnode *child = stackTop->fNodes.LeftMost();
+				if (child == NULL) {
+					ShmfsDirectoryVnode *done = stackTop;
+					stackTop = static_cast<ShmfsDirectoryVnode*>(done->fParent);
+					done->fParent = NULL;
+					volume->UnmapVnode(done);
+					reaper.Add(done);
+					continue;
+				}
+				if (!volume->IsUnmounting())
+					volume->IndexUnlinked(child);
+				stackTop->fNodes.Remove(child);
+				if (removeFromVfs)
+					child->RemoveFromVfs();
+				if (child->IsDirectory()) {
+					stackTop = static_cast<ShmfsDirectoryVnode*>(child);
+					continue;
+				}
+				child->fParent = NULL;
+				volume->UnmapVnode(child);
+				reaper.Add(child);
+			}
+		}
+		reaper.Flush();
+	}
+}
+
+status_t ShmfsDirectoryVnode::RemoveTree(const char* name)
+{
+	ShmfsVnodeReaper reaper;
+	reaper.Init();
+
+	ino_t id;
+	ShmfsDirectoryVnode *dir;
+	{
+	RecursiveLocker lock(Volume()->Lock());
+	TRACE("#%" B_PRId64 ".DirectoryVnode::RemoveTree(\"%s\")\n", Id(), name);
+
+	ShmfsVnode *vnode = FindNode(name);
+	if (vnode == NULL)
+		return B_ENTRY_NOT_FOUND;
+
+	if (!vnode->IsDirectory()) {
+		lock.Unlock();
+		return Unlink(name);
+	}
+
+	if (IsFrozen() || vnode->IsFrozen() || static_cast<ShmfsDirectoryVnode*>(vnode)->fFrozenCount > 0)
+		return B_NOT_ALLOWED;
+
+	// detach the whole subtree, the reference owned by fNodes is now ours
+	id = vnode->Id();
+	RemoveNode(vnode);
+	vnode->RemoveFromVfs();
+	BeginStatChange();
+	fModifyTime = fChangeTime = GetCurrentTime();
+	EndStatChange();
+	dir = static_cast<ShmfsDirectoryVnode*>(vnode);
+	}
+	notify_entry_removed(Volume()->Id(), Id(), name, id);
+
+	ReapTree(dir, reaper, true);
+
+	return B_OK;
+}
+
+// Looks up the directory that contains the last component of a relative path.
+// Called with the volume lock held, path is split in place.
+status_t ShmfsDirectoryVnode::ResolvePath(char* path, ShmfsDirectoryVnode* &dir, const char* &name)
+{
+	dir = this;
+	for (;;) {
+		while (*path == '/')
+			path++;
+		char* end = strchr(path, '/');
+		if (end == NULL || end[strspn(end, "/")] == '\0') {
+			if (end != NULL)
+				*end = '\0';
+			name = path;
+			break;
+		}
+		*end = '\0';
+		if (strcmp(path, ".") == 0 || strcmp(path, "..") == 0)
+			return B_BAD_VALUE;
+		ShmfsVnode *vnode = dir->FindNode(path);
+		if (vnode == NULL)
+			return B_ENTRY_NOT_FOUND;
+		if (!vnode->IsDirectory())
+			return B_NOT_A_DIRECTORY;
+		dir = static_cast<ShmfsDirectoryVnode*>(vnode);
+		path = end + 1;
+	}
+	if (*name == '\0' || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+		return B_BAD_VALUE;
+	return B_OK;
+}
+
+status_t ShmfsDirectoryVnode::CreateBatch(const void* buffer, size_t length)
+{
+	// Entries are processed in chunks: paths and symlink targets are copied
+	// in first, then the chunk is created under one volume lock acquisition
+	// and the notifications for it are sent after the lock is released.
+	const uint32 kChunkSize = 32;
+	struct Chunk {
+		shmfs_create_entry entries[kChunkSize];
+		char paths[kChunkSize][B_PATH_NAME_LENGTH];
+		char targets[kChunkSize][B_PATH_NAME_LENGTH];
+		const char* names[kChunkSize];
+		ino_t dirIds[kChunkSize];
+	};
+
+	shmfs_create_batch batch;
+	if (length < sizeof(batch))
+		return B_BAD_VALUE;
+	CHECK_RET(CopyFromIoctlBuffer(&batch, buffer, sizeof(batch)));
+	// Pointers in a user buffer must not reach into the kernel. All copies
+	// use the address space of the buffer, not that of each chunk.
+	const bool user = IS_USER_ADDRESS(buffer);
+	if (batch.count > SIZE_MAX / sizeof(shmfs_create_entry))
+		return B_BAD_VALUE;
+	if (user && !IsUserRange(batch.entries, (uint64)batch.count * sizeof(shmfs_create_entry)))
+		return B_BAD_ADDRESS;
+
+	ObjectDeleter<Chunk> chunk(new(std::nothrow) Chunk);
+	if (!chunk.IsSet())
+		return B_NO_MEMORY;
+
+	for (uint32 first = 0; first < batch.count; first += kChunkSize) {
+		uint32 count = std::min(batch.count - first, kChunkSize);
+		CHECK_RET(CopyFromIoctlBuffer(chunk->entries, batch.entries + first, count * sizeof(shmfs_create_entry), user));
+
+		for (uint32 i = 0; i < count; i++) {
+			shmfs_create_entry &entry = chunk->entries[i];
+			entry.id = -1;
+			// data is only read for files and symlinks, it may be NULL if
+			// there is none
+			bool hasData = entry.size > 0
+				&& (entry.type == SHMFS_CREATE_FILE || entry.type == SHMFS_CREATE_SYMLINK);
+			if (hasData && entry.size > SIZE_MAX) {
+				entry.status = B_BAD_VALUE;
+				continue;
+			}
+			if (user && (!IS_USER_ADDRESS(entry.path) || (hasData && !IsUserRange(entry.data, entry.size)))) {
+				entry.status = B_BAD_ADDRESS;
+				continue;
+			}
+			entry.status = CopyStringFromIoctlBuffer(chunk->paths[i], entry.path, B_PATH_NAME_LENGTH, user);
+			if (entry.status < B_OK || entry.type != SHMFS_CREATE_SYMLINK)
+				continue;
+			if (entry.size >= B_PATH_NAME_LENGTH)
+				entry.status = B_NAME_TOO_LONG;
+			else
+				entry.status = CopyFromIoctlBuffer(chunk->targets[i], entry.data, entry.size, user);
+			chunk->targets[i][std::min<uint64>(entry.size, B_PATH_NAME_LENGTH - 1)] = '\0';
+		}
+
+		{
+			RecursiveLocker lock(Volume()->Lock());
+			for (uint32 i = 0; i < count; i++) {
+				shmfs_create_entry &entry = chunk->entries[i];
+				if (entry.status < B_OK)
+					continue;
+
+				ShmfsDirectoryVnode *dir;
+				entry.status = ResolvePath(chunk->paths[i], dir, chunk->names[i]);
+				if (entry.status < B_OK)
+					continue;
+				if (dir->FindNode(chunk->names[i]) != NULL) {
+					entry.status = B_FILE_EXISTS;
+					continue;
+				}
+
+				Type type;
+				switch (entry.type) {
+					case SHMFS_CREATE_FILE:
+						type = kFile;
+						break;
+					case SHMFS_CREATE_DIRECTORY:
+						type = kDirectory;
+						break;
+					case SHMFS_CREATE_SYMLINK:
+						type = kSymlink;
+						break;
+					default:
+						entry.status = B_BAD_VALUE;
+						continue;
+				}
+
+				ShmfsVnode *vnode;
+				entry.status = dir->CreateNode(type, chunk->names[i], entry.mode, chunk->targets[i], vnode);
+				if (entry.status < B_OK)
+					continue;
+				if (type == kFile) {
+					entry.status = static_cast<ShmfsFileVnode*>(vnode)->WriteInitialData(entry.data, entry.size);
+					if (entry.status < B_OK) {
+						// don't leave a truncated file behind, a retry of
+						// the entry must not fail with B_FILE_EXISTS
+						dir->RemoveNode(vnode);
+						vnode->RemoveFromVfs();
+						put_vnode(Volume()->Base(), vnode->Id());
+						vnode->ReleaseReference();
+						continue;
+					}
+					put_vnode(Volume()->Base(), vnode->Id());
+				}
+				entry.id = vnode->Id();
+				chunk->dirIds[i] = dir->Id();
+			}
+		}
+
+		for (uint32 i = 0; i < count; i++) {
+			if (chunk->entries[i].id >= 0)
+				notify_entry_created(Volume()->Id(), chunk->dirIds[i], chunk->names[i], chunk->entries[i].id);
+		}
+
+		CHECK_RET(CopyToIoctlBuffer(batch.entries + first, chunk->entries, count * sizeof(shmfs_create_entry), user));
+	}
+
+	return B_OK;
+}
+
+// Marks the subtree frozen, walking it without recursion. Frozen roots count
+// in all their ancestors, so the ancestors can't be torn down as a tree.
+status_t ShmfsDirectoryVnode::Freeze()
+{
+	RecursiveLocker lock(Volume()->Lock());
+
+	// can't be undone until unmount, only root or the owner with write
+	// permission may freeze
+	uid_t uid = geteuid();
+	if (uid != 0 && (uid != fUid || (fMode & S_IWUSR) == 0))
+		return B_NOT_ALLOWED;
+
+	if (IsFrozen())
+		return B_OK;
+
+	// large attribute writes in flight don't hold the volume lock, they must
+	// be done before the subtree counts as immutable
+	Volume()->WaitForAttrWriters();
+
+	// everything written so far must be visible to readers that see a flag
+	memory_write_barrier();
+
+	ShmfsVnode *vnode = this;
+	for (;;) {
+		vnode->fFrozen = true;
+		if (vnode->IsDirectory()) {
+			ShmfsVnode *child = static_cast<ShmfsDirectoryVnode*>(vnode)->fNodes.LeftMost();
+			if (child != NULL) {
+				vnode = child;
+				continue;
+			}
+		}
+		// no children, continue with the next sibling of the closest ancestor
+		// that has one
+		while (vnode != this) {
+			ShmfsDirectoryVnode *parent = static_cast<ShmfsDirectoryVnode*>(vnode->fParent);
+			ShmfsVnode *next = parent->fNodes.Next(vnode);
+			if (next != NULL) {
+				vnode = next;
+				break;
+			}
+			vnode = parent;
+		}
+		if (vnode == this)
+			break;
+	}
+
+	if (fParent != NULL)
+		static_cast<ShmfsDirectoryVnode*>(fParent)->AddFrozenCount(1);
+	return B_OK;
 }
 
 
 //#pragma mark - VFS interface
 
+status_t ShmfsDirectoryVnode::Ioctl(void* _cookie, uint32 op, void* buffer, size_t length)
+{
+	ShmfsDirIterator* cookie = (ShmfsDirIterator*)_cookie;
+	switch (op) {
+		case SHMFS_IOCTL_DIR_TELL:
+		case SHMFS_IOCTL_DIR_SEEK:
+		case SHMFS_IOCTL_DIR_SEEK_NAME:
+		case SHMFS_IOCTL_READ_DIR_STAT:
+			// only directories opened with opendir() have a cookie
+			if (cookie == NULL)
+				return B_BAD_VALUE;
+			break;
+	}
+	switch (op) {
+		case SHMFS_IOCTL_DIR_TELL: {
+			RecursiveLocker lock(Volume()->Lock());
+			uint64 pos = cookie->pos;
+			lock.Unlock();
+			return CopyToIoctlBuffer(buffer, &pos, sizeof(pos));
+		}
+		case SHMFS_IOCTL_DIR_SEEK: {
+			uint64 pos;
+			CHECK_RET(CopyFromIoctlBuffer(&pos, buffer, sizeof(pos)));
+			RecursiveLocker lock(Volume()->Lock());
+			cookie->pos = pos;
+			return B_OK;
+		}
+		case SHMFS_IOCTL_DIR_SEEK_NAME: {
+			char name[B_FILE_NAME_LENGTH];
+			CHECK_RET(CopyStringFromIoctlBuffer(name, (const char*)buffer, sizeof(name)));
+			RecursiveLocker lock(Volume()->Lock());
+			if (strcmp(name, ".") == 0) {
+				cookie->pos = kDirPosDot;
+				return B_OK;
+			}
+			if (strcmp(name, "..") == 0) {
+				cookie->pos = kDirPosDotDot;
+				return B_OK;
+			}
+			ShmfsVnode *vnode = FindNode(name);
+			if (vnode == NULL)
+				return B_ENTRY_NOT_FOUND;
+			cookie->pos = vnode->fDirPos;
+			return B_OK;
+		}
+		case SHMFS_IOCTL_READ_DIR_STAT:
+			return ReadDirStat(cookie, buffer, length);
+		case SHMFS_IOCTL_CREATE_BATCH:
+			return CreateBatch(buffer, length);
+		case SHMFS_IOCTL_FREEZE:
+			return Freeze();
+		case SHMFS_IOCTL_REMOVE_TREE: {
+			char name[B_FILE_NAME_LENGTH];
+			CHECK_RET(CopyStringFromIoctlBuffer(name, (const char*)buffer, sizeof(name)));
+			return RemoveTree(name);
+		}
+	}
+	return ShmfsVnode::Ioctl(cookie, op, buffer, length);
+}
+
 status_t ShmfsDirectoryVnode::CreateSymlink(const char* name, const char* path, int mode)
 {
 	ino_t id;
@@ -103,23 +607,12 @@ status_t ShmfsDirectoryVnode::CreateSymlink(const char* name, const char* path,
 	RecursiveLocker lock(Volume()->Lock());
 	TRACE("#%" B_PRId64 ".DirectoryVnode::CreateSymlink(\"%s\", \"%s\")\n", Id(), name, path);
 
-	if (fNodes.Find(name))
+	if (FindNode(name) != NULL)
 		return B_FILE_EXISTS;
 
-	BReference<ShmfsSymlinkVnode> vnode(new (std::nothrow) ShmfsSymlinkVnode(), true);
-	if (!vnode.IsSet())
-		return B_NO_MEMORY;
-
-	CHECK_RET(vnode->SetName(name));
-	CHECK_RET(vnode->SetPath(path));
-	vnode->fParent = this;
-	vnode->fMode = mode & S_IUMSK;
-	CHECK_RET(Volume()->RegisterVnode(vnode));
+	ShmfsVnode *vnode;
+	CHECK_RET(CreateNode(kSymlink, name, mode, path, vnode));
 	id = vnode->Id();
-
-	InitTimestamps(vnode.Get());
-	fNodes.Insert(vnode);
-	vnode.Detach();
 	}
 
 	notify_entry_created(Volume()->Id(), Id(), name, id);
@@ -134,19 +627,19 @@ status_t ShmfsDirectoryVnode::Unlink(const char* name)
 	RecursiveLocker lock(Volume()->Lock());
 	TRACE("#%" B_PRId64 ".DirectoryVnode::Unlink(\"%s\")\n", Id(), name);
 
-	ShmfsVnode *vnode = fNodes.Find(name);
+	if (IsFrozen())
+		return B_NOT_ALLOWED;
+
+	ShmfsVnode *vnode = FindNode(name);
 	if (vnode == NULL)
 		return B_ENTRY_NOT_FOUND;
 
-	if (dynamic_cast<ShmfsDirectoryVnode*>(vnode) != NULL)
+	if (vnode->IsDirectory())
 		return B_IS_A_DIRECTORY;
 
 	id = vnode->Id();
 	RemoveNode(vnode);
-	if (acquire_vnode(Volume()->Base(), vnode->Id()) >= B_OK) {
-		remove_vnode(Volume()->Base(), vnode->Id());
-		put_vnode(Volume()->Base(), vnode->Id());
-	}
+	vnode->RemoveFromVfs();
 	vnode->ReleaseReference();
 	}
 	notify_entry_removed(Volume()->Id(), Id(), name, id);
@@ -161,17 +654,26 @@ status_t ShmfsDirectoryVnode::Rename(const char* fromName, ShmfsVnode* toDir, co
 	RecursiveLocker lock(Volume()->Lock());
 	TRACE("#%" B_PRId64 ".DirectoryVnode::Rename()\n", Id());
 
-	ShmfsDirectoryVnode *dstDirVnode = dynamic_cast<ShmfsDirectoryVnode*>(toDir);
-	if (dstDirVnode == NULL)
+	if (!toDir->IsDirectory())
 		return B_NOT_A_DIRECTORY;
+	ShmfsDirectoryVnode *dstDirVnode = static_cast<ShmfsDirectoryVnode*>(toDir);
 
-	ShmfsVnode *vnode = fNodes.Find(fromName);
+	ShmfsVnode *vnode = FindNode(fromName);
 	if (vnode == NULL)
 		return B_ENTRY_NOT_FOUND;
 
-	ShmfsVnode* oldDstVnode = dstDirVnode->fNodes.Find(toName);
+	if (IsFrozen() || dstDirVnode->IsFrozen() || vnode->IsFrozen())
+		return B_NOT_ALLOWED;
+
+	// a directory can't be moved below itself
+	for (ShmfsVnode *dir = dstDirVnode; dir != NULL; dir = dir->fParent) {
+		if (dir == vnode)
+			return B_BAD_VALUE;
+	}
+
+	ShmfsVnode* oldDstVnode = dstDirVnode->FindNode(toName);
 	if (oldDstVnode != NULL) {
-		if (dynamic_cast<ShmfsDirectoryVnode*>(oldDstVnode) != NULL) {
+		if (oldDstVnode->IsDirectory()) {
 			CHECK_RET(dstDirVnode->RemoveDir(toName));
 		} else {
 			CHECK_RET(dstDirVnode->Unlink(toName));
@@ -180,7 +682,7 @@ status_t ShmfsDirectoryVnode::Rename(const char* fromName, ShmfsVnode* toDir, co
 
 	RemoveNode(vnode);
 	vnode->SetName(toName);
-	dstDirVnode->fNodes.Insert(vnode);
+	dstDirVnode->InsertNode(vnode);
 
 	id = vnode->Id();
 	srcDirId = Id();
@@ -191,13 +693,13 @@ status_t ShmfsDirectoryVnode::Rename(const char* fromName, ShmfsVnode* toDir, co
 	return B_OK;
 }
 
-status_t ShmfsDirectoryVnode::ReadStat(struct stat &stat)
+void ShmfsDirectoryVnode::FillStat(struct stat &stat)
 {
-	RecursiveLocker lock(Volume()->Lock());
-	TRACE("#%" B_PRId64 ".DirectoryVnode::ReadStat()\n", Id());
-	CHECK_RET(ShmfsVnode::ReadStat(stat));
+	ShmfsVnode::FillStat(stat);
 	stat.st_mode |= S_IFDIR;
-	return B_OK;
+	// report the subtree totals, so du does not need to walk the tree
+	stat.st_size = fUsage.bytes;
+	stat.st_blocks = fUsage.pages * (B_PAGE_SIZE / 512);
 }
 
 status_t ShmfsDirectoryVnode::Create(const char* name, int openMode, int perms, ShmfsFileCookie* &cookie, ino_t &newVnodeID)
@@ -209,9 +711,9 @@ status_t ShmfsDirectoryVnode::Create(const char* name, int openMode, int perms,
 	if (strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
 		return B_IS_A_DIRECTORY;
 
-	ShmfsVnode *oldVnode = fNodes.Find(name);
+	ShmfsVnode *oldVnode = FindNode(name);
 	if (oldVnode != NULL) {
-		if (dynamic_cast<ShmfsDirectoryVnode*>(oldVnode) != NULL)
+		if (oldVnode->IsDirectory())
 			return B_IS_A_DIRECTORY;
 		if ((O_EXCL & openMode) != 0)
 			return B_FILE_EXISTS;
@@ -220,26 +722,14 @@ status_t ShmfsDirectoryVnode::Create(const char* name, int openMode, int perms,
 		return B_OK;
 	}
 
-	BReference<ShmfsFileVnode> vnode(new (std::nothrow) ShmfsFileVnode(), true);
-	if (!vnode.IsSet())
-		return B_NO_MEMORY;
-
-	CHECK_RET(vnode->SetName(name));
-	vnode->fParent = this;
-	vnode->fMode = perms & S_IUMSK;
-	CHECK_RET(vnode->Open(openMode, cookie));
-	CHECK_RET(Volume()->RegisterVnode(vnode));
+	ShmfsVnode *vnode;
+	CHECK_RET(CreateNode(kFile, name, perms, NULL, vnode));
 	newVnodeID = vnode->Id();
-	CHECK_RET(get_vnode(Volume()->Base(), vnode->Id(), NULL));
-	status_t res = vnode->Init();
+	status_t res = vnode->Open(openMode, cookie);
 	if (res < B_OK) {
-		put_vnode(Volume()->Base(), vnode->Id());
-		vnode.Detach();
+		put_vnode(Volume()->Base(), newVnodeID);
 		return res;
 	}
-	InitTimestamps(vnode.Get());
-	fNodes.Insert(vnode);
-	vnode.Detach();
 	}
 	notify_entry_created(Volume()->Id(), Id(), name, newVnodeID);
 
@@ -253,22 +743,12 @@ status_t ShmfsDirectoryVnode::CreateDir(const char* name, int perms)
 	RecursiveLocker lock(Volume()->Lock());
 	TRACE("#%" B_PRId64 ".DirectoryVnode::CreateDir()\n", Id());
 
-	if (fNodes.Find(name) || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
+	if (FindNode(name) != NULL || strcmp(name, ".") == 0 || strcmp(name, "..") == 0)
 		return B_FILE_EXISTS;
 
-	BReference<ShmfsDirectoryVnode> vnode(new (std::nothrow) ShmfsDirectoryVnode(), true);
-	if (!vnode.IsSet())
-		return B_NO_MEMORY;
-
-	CHECK_RET(vnode->SetName(name));
-	vnode->fParent = this;
-	vnode->fMode = perms & S_IUMSK;
-	CHECK_RET(Volume()->RegisterVnode(vnode));
+	ShmfsVnode *vnode;
+	CHECK_RET(CreateNode(kDirectory, name, perms, NULL, vnode));
 	id = vnode->Id();
-
-	InitTimestamps(vnode.Get());
-	fNodes.Insert(vnode);
-	vnode.Detach();
 	}
 	notify_entry_created(Volume()->Id(), Id(), name, id);
 
@@ -282,13 +762,16 @@ status_t ShmfsDirectoryVnode::RemoveDir(const char* name)
 	RecursiveLocker lock(Volume()->Lock());
 	TRACE("#%" B_PRId64 ".DirectoryVnode::RemoveDir(\"%s\")\n", Id(), name);
 
-	ShmfsVnode *vnode = fNodes.Find(name);
+	ShmfsVnode *vnode = FindNode(name);
 	if (vnode == NULL)
 		return B_ENTRY_NOT_FOUND;
 
-	ShmfsDirectoryVnode *dirVnode = dynamic_cast<ShmfsDirectoryVnode*>(vnode);
-	if (dirVnode == NULL)
+	if (!vnode->IsDirectory())
 		return B_NOT_A_DIRECTORY;
+	ShmfsDirectoryVnode *dirVnode = static_cast<ShmfsDirectoryVnode*>(vnode);
+
+	if (IsFrozen() || dirVnode->IsFrozen())
+		return B_NOT_ALLOWED;
 
 	if (!dirVnode->fNodes.IsEmpty())
 		return B_DIRECTORY_NOT_EMPTY;
@@ -305,7 +788,7 @@ status_t ShmfsDirectoryVnode::RemoveDir(const char* name)
 
 status_t ShmfsDirectoryVnode::Lookup(const char* name, ino_t &id)
 {
-	RecursiveLocker lock(Volume()->Lock());
+	RecursiveLocker lock(Volume()->Lock(), false, !IsFrozen());
 	TRACE("#%" B_PRId64 ".ShmfsDirectoryVnode::Lookup(\"%s\")\n", Id(), name);
 	if (strcmp(name, ".") == 0) {
 		id = Id();
@@ -314,7 +797,7 @@ status_t ShmfsDirectoryVnode::Lookup(const char* name, ino_t &id)
 			return B_ENTRY_NOT_FOUND;
 		id = fParent->Id();
 	} else {
-		ShmfsVnode *vnode = fNodes.Find(name);
+		ShmfsVnode *vnode = FindNode(name);
 		if (vnode == NULL)
 			return B_ENTRY_NOT_FOUND;
 		id = vnode->Id();
@@ -331,16 +814,13 @@ status_t ShmfsDirectoryVnode::OpenDir(ShmfsDirIterator* &cookie)
 	cookie = new (std::nothrow) ShmfsDirIterator();
 	if (cookie == NULL)
 		return B_NO_MEMORY;
-	fIterators.Insert(cookie);
-	IteratorRewind(cookie);
+	cookie->pos = kDirPosDot;
 	return B_OK;
 }
 
 status_t ShmfsDirectoryVnode::CloseDir(ShmfsDirIterator* cookie)
 {
-	RecursiveLocker lock(Volume()->Lock());
 	TRACE("#%" B_PRId64 ".DirectoryVnode::CloseDir()\n", Id());
-	fIterators.Remove(cookie);
 	return B_OK;
 }
 
@@ -353,46 +833,31 @@ status_t ShmfsDirectoryVnode::FreeDirCookie(ShmfsDirIterator* cookie)
 
 status_t ShmfsDirectoryVnode::ReadDir(ShmfsDirIterator* cookie, struct dirent* buffer, size_t bufferSize, uint32 &num)
 {
-	RecursiveLocker lock(Volume()->Lock());
+	RecursiveLocker lock(Volume()->Lock(), false, !IsFrozen());
 	TRACE("#%" B_PRId64 ".DirectoryVnode::ReadDir()\n", Id());
 
-	const char *name;
-	ShmfsVnode *vnode;
 	uint32 maxNum = num;
-	num = 0;
-
-	for (;;) {
-		if (!(num < maxNum))
-			break;
-
-		if (!IteratorGet(cookie, name, vnode))
-			break;
-
-		size_t direntSize = offsetof(struct dirent, d_name) + strlen(name) + 1;
-		if (bufferSize < direntSize) {
-			if (num == 0)
-				return B_BUFFER_OVERFLOW;
-			break;
-		}
+	return IterateEntries(cookie, maxNum, num, [&](const char* name, ShmfsVnode* vnode) {
+		size_t nameLen = strlen(name) + 1;
+		size_t direntSize = offsetof(struct dirent, d_name) + nameLen;
+		if (bufferSize < direntSize)
+			return false;
 		*buffer = {
 			.d_dev = Volume()->Id(),
 			.d_ino = vnode->Id(),
 			.d_reclen = (uint16)direntSize
 		};
-		strcpy(buffer->d_name, name);
+		memcpy(buffer->d_name, name, nameLen);
 		bufferSize -= direntSize;
 		*(uint8**)&buffer += direntSize;
-		num++;
-		IteratorNext(cookie);
-	}
-
-	return B_OK;
+		return true;
+	});
 }
 
 status_t ShmfsDirectoryVnode::RewindDir(ShmfsDirIterator* cookie)
 {
 	RecursiveLocker lock(Volume()->Lock());
 	TRACE("#%" B_PRId64 ".DirectoryVnode::RewindDir()\n", Id());
-	IteratorRewind(cookie);
+	cookie->pos = kDirPosDot;
 	return B_OK;
 }
@@ -0,0 +1,372 @@
+#include "Shmfs.h"
+
+#include <TypeConstants.h>
+#include <kernel.h>
+
+#include <new>
+#include <algorithm>
+#include <stdlib.h>
+
+
+static bool IsSignedType(uint32 type)
+{
+	switch (type) {
+		case B_INT8_TYPE:
+		case B_INT16_TYPE:
+		case B_INT32_TYPE:
+		case B_INT64_TYPE:
+		case B_TIME_TYPE:
+		case B_SSIZE_T_TYPE:
+		case B_OFF_T_TYPE:
+			return true;
+	}
+	return false;
+}
+
+static bool IsUnsignedType(uint32 type)
+{
+	switch (type) {
+		case B_BOOL_TYPE:
+		case B_UINT8_TYPE:
+		case B_UINT16_TYPE:
+		case B_UINT32_TYPE:
+		case B_UINT64_TYPE:
+		case B_SIZE_T_TYPE:
+			return true;
+	}
+	return false;
+}
+
+// Integer keys are compared by value, so the 8 byte query values match
+// attributes of any width. Keys of other lengths read as 0.
+static uint64 ReadInteger(const void* data, size_t length, bool isSigned)
+{
+	switch (length) {
+		case 1: {
+			uint8 value = *(const uint8*)data;
+			return isSigned ? (uint64)(int64)(int8)value : value;
+		}
+		case 2: {
+			uint16 value;
+			memcpy(&value, data, sizeof(value));
+			return isSigned ? (uint64)(int64)(int16)value : value;
+		}
+		case 4: {
+			uint32 value;
+			memcpy(&value, data, sizeof(value));
+			return isSigned ? (uint64)(int64)(int32)value : value;
+		}
+		case 8: {
+			uint64 value;
+			memcpy(&value, data, sizeof(value));
+			return value;
+		}
+	}
+	return 0;
+}
+
+
+//#pragma mark - ShmfsIndex
+
+int ShmfsIndex::EntryDef::Compare(const Key& a, const Value* b) const
+{
+	int cmp = CompareKeys(type, a.data, a.length, b->key, b->keyLength);
+	if (cmp != 0)
+		return cmp;
+	ino_t bId = b->vnode->Id();
+	return (a.id < bId) ? -1 : (a.id > bId) ? 1 : 0;
+}
+
+int ShmfsIndex::EntryDef::Compare(const Value* a, const Value* b) const
+{
+	return Compare(Key{a->key, a->keyLength, a->vnode->Id()}, b);
+}
+
+
+ShmfsIndex::ShmfsIndex(const char* name, uint32 type, Kind kind):
+	fType(type), fKind(kind), fEntries(EntryDef(type))
+{
+	strlcpy(fName, name, sizeof(fName));
+}
+
+ShmfsIndex::~ShmfsIndex()
+{
+	// free the entries bottom up without rebalancing, the nodes may be gone
+	// on unmount
+	Entry* root = fEntries.RootNode();
+	AVLTreeNode* node = root != NULL ? &root->treeNode : NULL;
+	while (node != NULL) {
+		AVLTreeNode* child = node->left != NULL ? node->left : node->right;
+		if (child != NULL) {
+			(node->left != NULL ? node->left : node->right) = NULL;
+			node = child;
+			continue;
+		}
+		AVLTreeNode* parent = node->parent;
+		free((uint8*)node - offsetof(Entry, treeNode));
+		node = parent;
+	}
+	fEntries.Clear();
+}
+
+bool ShmfsIndex::IsStringType(uint32 type)
+{
+	return type == B_STRING_TYPE || type == B_MIME_STRING_TYPE;
+}
+
+bool ShmfsIndex::IsSupportedType(uint32 type)
+{
+	return IsStringType(type) || IsSignedType(type) || IsUnsignedType(type);
+}
+
+int ShmfsIndex::CompareKeys(uint32 type, const void* a, size_t aLength, const void* b, size_t bLength)
+{
+	if (IsSignedType(type)) {
+		int64 aValue = (int64)ReadInteger(a, aLength, true);
+		int64 bValue = (int64)ReadInteger(b, bLength, true);
+		return (aValue < bValue) ? -1 : (aValue > bValue) ? 1 : 0;
+	}
+	if (IsUnsignedType(type)) {
+		uint64 aValue = ReadInteger(a, aLength, false);
+		uint64 bValue = ReadInteger(b, bLength, false);
+		return (aValue < bValue) ? -1 : (aValue > bValue) ? 1 : 0;
+	}
+	int cmp = memcmp(a, b, std::min(aLength, bLength));
+	if (cmp != 0)
+		return cmp;
+	return (aLength < bLength) ? -1 : (aLength > bLength) ? 1 : 0;
+}
+
+// Converts a query value to a key of the given type.
+bool ShmfsIndex::ParseKey(uint32 type, const char* string, uint8* key, size_t &length)
+{
+	if (IsStringType(type)) {
+		length = strnlen(string, kMaxKeyLength);
+		memcpy(key, string, length);
+		return true;
+	}
+	if (string[0] == '\0')
+		return false;
+	char* end;
+	uint64 value;
+	if (IsSignedType(type))
+		value = (uint64)strtoll(string, &end, 0);
+	else if (IsUnsignedType(type) && string[0] != '-')
+		value = strtoull(string, &end, 0);
+	else
+		return false;
+	if (*end != '\0')
+		return false;
+	memcpy(key, &value, sizeof(value));
+	length = sizeof(value);
+	return true;
+}
+
+// Gets the key of an attribute of a node, string values don't include the
+// terminating null. Returns false if the node has no such attribute.
+bool ShmfsIndex::GetAttrKey(ShmfsVnode* vnode, const char* name, uint32 &type, uint8* key, size_t &length)
+{
+	length = kMaxKeyLength;
+	if (!vnode->ReadAttrValue(name, type, key, length))
+		return false;
+	if (IsStringType(type))
+		length = strnlen((const char*)key, length);
+	return true;
+}
+
+// Gets the key of a node, returns false if the node is not indexed.
+bool ShmfsIndex::GetKey(ShmfsVnode* vnode, uint8* key, size_t &length)
+{
+	switch (fKind) {
+		case kName: {
+			const char* name = vnode->Name();
+			length = strnlen(name, kMaxKeyLength);
+			memcpy(key, name, length);
+			return true;
+		}
+		case kSize:
+		case kLastModified: {
+			if (vnode->GetType() != ShmfsVnode::kFile)
+				return false;
+			int64 value = fKind == kSize
+				? (int64)static_cast<ShmfsFileVnode*>(vnode)->DataSize()
+				: vnode->fModifyTime / 1000000000LL;
+			memcpy(key, &value, sizeof(value));
+			length = sizeof(value);
+			return true;
+		}
+		case kAttribute: {
+			uint32 type;
+			return GetAttrKey(vnode, fName, type, key, length) && type == fType;
+		}
+	}
+	return false;
+}
+
+status_t ShmfsIndex::Insert(ShmfsVnode* vnode, const uint8* key, size_t length)
+{
+	// a little slack lets most key changes reuse the entry
+	size_t capacity = ROUNDUP(length, 8);
+	Entry* entry = (Entry*)malloc(sizeof(Entry) + capacity);
+	if (entry == NULL)
+		return B_NO_MEMORY;
+	entry->vnode = vnode;
+	entry->keyLength = (uint16)length;
+	entry->keyCapacity = (uint16)capacity;
+	memcpy(entry->key, key, length);
+	status_t res = fEntries.Insert(entry);
+	if (res < B_OK)
+		free(entry);
+	return res;
+}
+
+void ShmfsIndex::Remove(ShmfsVnode* vnode, const uint8* key, size_t length)
+{
+	Entry* entry = fEntries.Find(Key{key, length, vnode->Id()});
+	if (entry == NULL)
+		return;
+	fEntries.Remove(entry);
+	free(entry);
+}
+
+// Moves the entry of a node from the old to the new key. A key that fits is
+// rewritten in place, otherwise the new entry is allocated before the old
+// one is removed. Only if that fails the node drops out of the index.
+status_t ShmfsIndex::Update(ShmfsVnode* vnode, const uint8* oldKey, size_t oldLength, const uint8* key, size_t length)
+{
+	Entry* entry = fEntries.Find(Key{oldKey, oldLength, vnode->Id()});
+	if (entry != NULL && length <= entry->keyCapacity) {
+		fEntries.Remove(entry);
+		entry->keyLength = (uint16)length;
+		memcpy(entry->key, key, length);
+		return fEntries.Insert(entry);
+	}
+	status_t res = Insert(vnode, key, length);
+	if (entry != NULL) {
+		fEntries.Remove(entry);
+		free(entry);
+	}
+	return res;
+}
+
+ShmfsIndex::Entry* ShmfsIndex::FindFirst(const uint8* key, size_t length)
+{
+	// node ids start at 1
+	return fEntries.FindClosest(Key{key, length, 0}, false);
+}
+
+
+//#pragma mark - ShmfsIndexUpdate
+
+void ShmfsIndexUpdate::AddKey(ShmfsIndex* index)
+{
+	OldKey &old = fOld[fCount++];
+	old.index = index;
+	old.indexed = index->GetKey(fVnode, old.key, old.length);
+}
+
+// Only queries that compare one of the changed values are evaluated, attrs
+// NULL stands for size and last_modified.
+void ShmfsIndexUpdate::MatchQueries(const char* const* attrs, int32 count)
+{
+	ShmfsVolume* volume = fVnode->Volume();
+	for (ShmfsQuery* query = volume->fLiveQueries.First(); query != NULL; query = volume->fLiveQueries.GetNext(query)) {
+		if (attrs == NULL)
+			query->fAffected = query->UsesProperty(ShmfsIndex::kSize) || query->UsesProperty(ShmfsIndex::kLastModified);
+		else {
+			query->fAffected = false;
+			for (int32 i = 0; i < count && !query->fAffected; i++)
+				query->fAffected = query->UsesAttr(attrs[i]);
+		}
+		if (query->fAffected)
+			query->fMatched = query->Matches(fVnode);
+	}
+}
+
+ShmfsIndexUpdate::ShmfsIndexUpdate(ShmfsVnode* vnode, const char* attr):
+	fVnode(vnode)
+{
+	// unlinked nodes are neither indexed nor reported to queries
+	if (vnode == NULL || vnode->fParent == NULL) {
+		fVnode = NULL;
+		return;
+	}
+
+	ShmfsVolume* volume = vnode->Volume();
+	if (attr == NULL) {
+		AddKey(volume->fSizeIndex);
+		AddKey(volume->fLastModifiedIndex);
+	} else {
+		ShmfsIndex* index = volume->FindIndex(attr);
+		if (index != NULL && index->GetKind() == ShmfsIndex::kAttribute)
+			AddKey(index);
+	}
+	MatchQueries(attr == NULL ? NULL : &attr, 1);
+}
+
+ShmfsIndexUpdate::ShmfsIndexUpdate(ShmfsVnode* vnode, const char* const* attrs, int32 count):
+	fVnode(vnode)
+{
+	if (vnode->fParent == NULL) {
+		fVnode = NULL;
+		return;
+	}
+
+	ShmfsVolume* volume = vnode->Volume();
+	int32 indexCount = 0;
+	for (int32 i = 0; i < count; i++) {
+		ShmfsIndex* index = volume->FindIndex(attrs[i]);
+		if (index != NULL && index->GetKind() == ShmfsIndex::kAttribute)
+			indexCount++;
+	}
+	if (indexCount > kMaxInlineIndexes) {
+		fOldData.SetTo(new(std::nothrow) OldKey[indexCount]);
+		if (!fOldData.IsSet()) {
+			fInitStatus = B_NO_MEMORY;
+			fVnode = NULL;
+			return;
+		}
+		fOld = &fOldData[0];
+	}
+	for (int32 i = 0; i < count; i++) {
+		ShmfsIndex* index = volume->FindIndex(attrs[i]);
+		if (index != NULL && index->GetKind() == ShmfsIndex::kAttribute)
+			AddKey(index);
+	}
+	MatchQueries(attrs, count);
+}
+
+ShmfsIndexUpdate::~ShmfsIndexUpdate()
+{
+	if (fVnode == NULL)
+		return;
+
+	uint8 key[ShmfsIndex::kMaxKeyLength];
+	size_t length;
+	for (int32 i = 0; i < fCount; i++) {
+		OldKey &old = fOld[i];
+		bool indexed = old.index->GetKey(fVnode, key, length);
+		if (indexed == old.indexed && (!indexed || (length == old.length && memcmp(key, old.key, length) == 0)))
+			continue;
+		if (!indexed) {
+			old.index->Remove(fVnode, old.key, old.length);
+			continue;
+		}
+		status_t res = old.indexed
+			? old.index->Update(fVnode, old.key, old.length, key, length)
+			: old.index->Insert(fVnode, key, length);
+		if (res < B_OK) {
+			dprintf("shmfs: node %" B_PRId64 " is missing from index \"%s\": %s\n",
+				fVnode->Id(), old.index->Name(), strerror(res));
+		}
+	}
+
+	ShmfsVolume* volume = fVnode->Volume();
+	for (ShmfsQuery* query = volume->fLiveQueries.First(); query != NULL; query = volume->fLiveQueries.GetNext(query)) {
+		if (!query->fAffected)
+			continue;
+		bool matched = query->Matches(fVnode);
+		if (matched != query->fMatched)
+			query->NotifyEntry(fVnode, matched);
+	}
+}
@@ -0,0 +1,154 @@
+#pragma once
+
+#include <SupportDefs.h>
+#include <sys/stat.h>
+
+
+// ioctl() operations understood by shmfs nodes.
+
+enum {
+	// Directory position of an open directory, stable while the entry exists.
+	// buffer: uint64*
+	SHMFS_IOCTL_DIR_TELL = 'shdt',
+	SHMFS_IOCTL_DIR_SEEK = 'shds',
+
+	// Position an open directory at the entry with the given name.
+	// buffer: const char*
+	SHMFS_IOCTL_DIR_SEEK_NAME = 'shdn',
+
+	// Read the next directory entries of an open directory together with
+	// their stat data.
+	// buffer: shmfs_dir_stat_buffer followed by space for the entries
+	SHMFS_IOCTL_READ_DIR_STAT = 'shrs',
+
+	// Recursively remove the entry with the given name from a directory. The
+	// subtree is detached at once and torn down on worker threads, only one
+	// entry removed notification is sent for its root.
+	// buffer: const char*
+	SHMFS_IOCTL_REMOVE_TREE = 'shrt',
+
+	// Create many files, directories and symlinks below a directory in one
+	// call. Processing continues after failing entries, the result of each
+	// entry is reported in its status field.
+	// buffer: shmfs_create_batch*
+	SHMFS_IOCTL_CREATE_BATCH = 'shcb',
+
+	// Space used by a node and, for directories, everything below it. The
+	// totals are maintained incrementally, reading them takes constant time.
+	// buffer: shmfs_usage*
+	SHMFS_IOCTL_GET_USAGE = 'shus',
+
+	// Usage and limits of a user or group on the volume of the node. Setting
+	// limits requires root, usage beyond a new limit is kept.
+	// buffer: shmfs_quota*
+	SHMFS_IOCTL_GET_QUOTA = 'shqg',
+	SHMFS_IOCTL_SET_QUOTA = 'shqs',
+
+	// Make a directory and everything below it immutable. Changes to the
+	// subtree fail with B_NOT_ALLOWED from then on, and lookups, directory
+	// reads, stat and file reads in it no longer take the volume lock. There
+	// is no way back until unmount. Only root or the owner of the directory
+	// with write permission may freeze it.
+	// buffer: unused
+	SHMFS_IOCTL_FREEZE = 'shfz',
+
+	// Read all attributes of a node, names, types and values, in one call.
+	// Fails with B_BUFFER_OVERFLOW if they don't fit, the size field then
+	// holds the needed buffer size. Values larger than
+	// SHMFS_MAX_BULK_ATTR_VALUE_SIZE are left out and flagged.
+	// buffer: shmfs_attr_buffer followed by space for the entries
+	SHMFS_IOCTL_READ_ATTRS = 'shra',
+
+	// Write or remove many attributes of a node at once. Either all entries
+	// are applied or, on failure, none. Each name may appear only once.
+	// Both calls are limited to SHMFS_MAX_BULK_ATTR_BUFFER_SIZE bytes.
+	// buffer: shmfs_attr_buffer followed by the entries
+	SHMFS_IOCTL_WRITE_ATTRS = 'shwa',
+};
+
+
+struct shmfs_dir_stat_entry {
+	struct stat	stat;
+	uint16		reclen;		// size of the record, a multiple of 8
+	char		name[];
+};
+
+struct shmfs_dir_stat_buffer {
+	uint32		count;		// out: number of records that follow
+	uint32		reserved;
+	// shmfs_dir_stat_entry records follow
+};
+
+
+enum {
+	SHMFS_CREATE_FILE		= 0,
+	SHMFS_CREATE_DIRECTORY	= 1,
+	SHMFS_CREATE_SYMLINK	= 2,
+};
+
+struct shmfs_create_entry {
+	const char*	path;		// relative to the directory, '/' separated,
+							// parent directories must already exist
+	const void*	data;		// initial file contents or symlink target
+	uint64		size;		// size of data
+	uint32		type;		// SHMFS_CREATE_*
+	uint32		mode;		// permission bits
+	status_t	status;		// out
+	uint32		reserved;
+	ino_t		id;			// out
+};
+
+struct shmfs_create_batch {
+	shmfs_create_entry*	entries;
+	uint32				count;
+	uint32				reserved;
+};
+
+
+struct shmfs_usage {
+	uint64		bytes;		// file data size
+	uint64		pages;		// memory pages holding file data
+	uint64		nodes;		// number of nodes, including the node itself
+};
+
+
+#define SHMFS_MAX_BULK_ATTR_VALUE_SIZE	(64 * 1024)
+#define SHMFS_MAX_BULK_ATTR_BUFFER_SIZE	(4 * 1024 * 1024)
+
+enum {
+	SHMFS_ATTR_REMOVE		= 0x01,	// write: remove the attribute
+	SHMFS_ATTR_OMITTED		= 0x02,	// read: the value is not included
+};
+
+struct shmfs_attr_entry {
+	uint32		type;
+	uint32		flags;		// SHMFS_ATTR_*
+	uint64		size;		// size of the value
+	uint32		reclen;		// size of the record, a multiple of 8
+	uint16		name_size;	// including the terminating null
+	uint16		reserved;
+	char		name[];		// followed by the value
+};
+
+struct shmfs_attr_buffer {
+	uint32		count;		// number of records that follow, out for reads
+	uint32		reserved;
+	uint64		size;		// size of the buffer including this header,
+							// out for reads
+	// shmfs_attr_entry records follow
+};
+
+
+enum {
+	SHMFS_QUOTA_USER	= 0,
+	SHMFS_QUOTA_GROUP	= 1,
+};
+
+struct shmfs_quota {
+	uint32		type;		// SHMFS_QUOTA_*
+	uint32		id;			// uid or gid
+	int64		max_pages;	// -1 for no limit, in for SHMFS_IOCTL_SET_QUOTA
+	int64		max_nodes;
+	int64		used_pages;	// out
+	int64		used_nodes;	// out
+};
@@ -0,0 +1,100 @@
+#include "Shmfs.h"
+
+#include <util/AutoLock.h>
+
+#include <stdlib.h>
+
+
+//#pragma mark - ShmfsPooledName
+
+void ShmfsPooledName::AcquireReference()
+{
+	MutexLocker lock(&fPool->fLock);
+	fRefCount++;
+}
+
+void ShmfsPooledName::ReleaseReference()
+{
+	fPool->Release(this);
+}
+
+
+//#pragma mark - ShmfsNamePool
+
+ShmfsNamePool::~ShmfsNamePool()
+{
+	ShmfsPooledName* name = fNames.Clear(true);
+	while (name != NULL) {
+		ShmfsPooledName* next = name->fHashLink;
+		free(name);
+		name = next;
+	}
+	mutex_destroy(&fLock);
+}
+
+status_t ShmfsNamePool::Init()
+{
+	return fNames.Init();
+}
+
+uint32 ShmfsNamePool::HashName(const char* name)
+{
+	// FNV-1a
+	uint32 hash = 2166136261U;
+	for (; *name != '\0'; name++)
+		hash = (hash ^ (uint8)*name) * 16777619U;
+	return hash;
+}
+
+status_t ShmfsNamePool::Acquire(const char* name, ShmfsPooledName* &pooledName)
+{
+	MutexLocker lock(&fLock);
+
+	ShmfsPooledName* entry = fNames.Lookup(name);
+	if (entry != NULL) {
+		entry->fRefCount++;
+		pooledName = entry;
+		return B_OK;
+	}
+
+	size_t len = strlen(name) + 1;
+	entry = (ShmfsPooledName*)malloc(offsetof(ShmfsPooledName, fName) + len);
+	if (entry == NULL)
+		return B_NO_MEMORY;
+	entry->fHashLink = NULL;
+	entry->fPool = this;
+	entry->fRefCount = 1;
+	entry->fHash = HashName(name);
+	memcpy(entry->fName, name, len);
+
+	status_t res = fNames.Insert(entry);
+	if (res < B_OK) {
+		free(entry);
+		return res;
+	}
+
+	pooledName = entry;
+	return B_OK;
+}
+
+// Called on unmount before the tree is torn down. Releases become no-ops, so
+// the reaper threads don't contend on the pool lock, and the destructor frees
+// all names in one pass.
+void ShmfsNamePool::Discard()
+{
+	MutexLocker lock(&fLock);
+	fDiscarding = true;
+}
+
+void ShmfsNamePool::Release(ShmfsPooledName* name)
+{
+	// set before any reaper thread runs, never reset
+	if (fDiscarding)
+		return;
+	MutexLocker lock(&fLock);
+	if (--name->fRefCount > 0)
+		return;
+	fNames.RemoveUnchecked(name);
+	lock.Unlock();
+	free(name);
+}
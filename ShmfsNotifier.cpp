@@ -0,0 +1,91 @@
+#include "Shmfs.h"
+
+#include <KernelExport.h>
+#include <NodeMonitor.h>
+
+#include <util/AutoLock.h>
+
+
+ShmfsNotifier::~ShmfsNotifier()
+{
+	Shutdown();
+	if (fSem >= B_OK)
+		delete_sem(fSem);
+}
+
+status_t ShmfsNotifier::Init(ShmfsVolume* volume)
+{
+	fVolume = volume;
+	fSem = create_sem(0, "shmfs notifier");
+	if (fSem < B_OK)
+		return fSem;
+	fThread = spawn_kernel_thread(ThreadEntry, "shmfs notifier", B_NORMAL_PRIORITY, this);
+	if (fThread < B_OK)
+		return fThread;
+	resume_thread(fThread);
+	return B_OK;
+}
+
+status_t ShmfsNotifier::ThreadEntry(void* arg)
+{
+	ShmfsNotifier* notifier = (ShmfsNotifier*)arg;
+	for (;;) {
+		if (acquire_sem(notifier->fSem) < B_OK || notifier->fQuit)
+			return B_OK;
+		// let the burst that woke us up collect into the pending masks
+		snooze(kWindow);
+		notifier->Flush();
+	}
+}
+
+// Sends the pending notifications. A node that changes again while it is
+// being flushed is either covered by the mask read here or queued anew.
+void ShmfsNotifier::Flush()
+{
+	ShmfsVnode* list;
+	{
+		RecursiveLocker lock(fVolume->Lock());
+		list = fPending;
+		fPending = NULL;
+	}
+	while (list != NULL) {
+		ShmfsVnode* vnode = list;
+		uint32 mask;
+		ino_t dirId;
+		{
+			RecursiveLocker lock(fVolume->Lock());
+			list = vnode->fNotifyNext;
+			vnode->fNotifyNext = NULL;
+			mask = vnode->fPendingStatMask;
+			vnode->fPendingStatMask = 0;
+			dirId = vnode->fParent == NULL ? 0 : vnode->fParent->Id();
+		}
+		notify_stat_changed(fVolume->Id(), dirId, vnode->Id(), mask);
+		vnode->ReleaseReference();
+	}
+}
+
+void ShmfsNotifier::StatChanged(ShmfsVnode* vnode, uint32 statMask)
+{
+	if (vnode->fPendingStatMask == 0) {
+		vnode->AcquireReference();
+		vnode->fNotifyNext = fPending;
+		if (fPending == NULL)
+			release_sem_etc(fSem, 1, B_DO_NOT_RESCHEDULE);
+		fPending = vnode;
+	}
+	vnode->fPendingStatMask |= statMask;
+}
+
+void ShmfsNotifier::Shutdown()
+{
+	if (fThread >= B_OK) {
+		fQuit = true;
+		release_sem(fSem);
+		status_t res;
+		wait_for_thread(fThread, &res);
+		fThread = -1;
+	}
+	if (fVolume != NULL)
+		Flush();
+}
@@ -0,0 +1,207 @@
+/*
+ * DoIO, GetPages, PutPages are based on Haiku `ramfs` code under following license:
+ *
+ * Copyright 2007, Ingo Weinhold, ingo_weinhold@gmx.de.
+ * Copyright 2019, Haiku, Inc.
+ * All rights reserved. Distributed under the terms of the MIT license.
+ */
+
+
+#include "Shmfs.h"
+
+#include <KernelExport.h>
+
+#include <kernel.h>
+#include <vm/VMCache.h>
+#include <vm/vm_page.h>
+
+#include <util/AutoLock.h>
+
+#include <new>
+#include <algorithm>
+
+
+ShmfsPageCache::~ShmfsPageCache()
+{
+	if (fCache != NULL) {
+		fCache->ReleaseRef();
+		fCache = NULL;
+	}
+}
+
+status_t ShmfsPageCache::Init()
+{
+	CHECK_RET(VMCacheFactory::CreateAnonymousCache(fCache, false, 0, 0, false, VM_PRIORITY_SYSTEM));
+	fCache->temporary = true;
+	return B_OK;
+}
+
+// Shrinking frees the pages past the new size, growing adds no pages.
+status_t ShmfsPageCache::Resize(off_t size)
+{
+	AutoLocker<VMCache> _(fCache);
+	return fCache->Resize(size, VM_PRIORITY_SYSTEM);
+}
+
+uint64 ShmfsPageCache::PageCount()
+{
+	AutoLocker<VMCache> _(fCache);
+	return fCache->page_count;
+}
+
+
+status_t ShmfsPageCache::DoIO(const off_t offset, uint8* buffer, ssize_t length, size_t &bytesProcessed, bool isWrite, ShmfsVnode* owner)
+{
+	const size_t originalLength = length;
+	const bool user = IS_USER_ADDRESS(buffer);
+
+	const off_t rounded_offset = ROUNDDOWN(offset, B_PAGE_SIZE);
+	const size_t rounded_len = ROUNDUP((length) + (offset - rounded_offset),
+		B_PAGE_SIZE);
+	vm_page** pages = new(std::nothrow) vm_page*[rounded_len / B_PAGE_SIZE];
+	if (pages == NULL)
+		return B_NO_MEMORY;
+	ArrayDeleter<vm_page*> pagesDeleter(pages);
+
+	status_t error = GetPages(rounded_offset, rounded_len, isWrite, owner, pages);
+	if (error != B_OK) {
+		bytesProcessed = 0;
+		return error;
+	}
+
+	size_t index = 0;
+
+	while (length > 0) {
+		vm_page* page = pages[index];
+		phys_addr_t at = (page != NULL)
+			? (page->physical_page_number * B_PAGE_SIZE) : 0;
+		ssize_t bytes = B_PAGE_SIZE;
+		if (index == 0) {
+			const uint32 pageoffset = (offset % B_PAGE_SIZE);
+			at += pageoffset;
+			bytes -= pageoffset;
+		}
+		bytes = std::min<ssize_t>(length, bytes);
+
+		if (isWrite) {
+			page->modified = true;
+			error = vm_memcpy_to_physical(at, buffer, bytes, user);
+		} else {
+			if (page != NULL) {
+				error = vm_memcpy_from_physical(buffer, at, bytes, user);
+			} else {
+				if (user) {
+					error = user_memset(buffer, 0, bytes);
+				} else {
+					memset(buffer, 0, bytes);
+				}
+			}
+		}
+		if (error != B_OK)
+			break;
+
+		buffer += bytes;
+		length -= bytes;
+		index++;
+	}
+
+	PutPages(rounded_offset, rounded_len, pages, error == B_OK);
+
+	bytesProcessed = length > 0 ? originalLength - length : originalLength;
+
+	return error;
+}
+
+status_t ShmfsPageCache::GetPages(off_t offset, off_t length, bool isWrite, ShmfsVnode* owner, vm_page** pages)
+{
+	// TODO: This method is duplicated in the ram_disk. Perhaps it
+	// should be put into a common location?
+
+	// get the pages, we already have
+	AutoLocker<VMCache> locker(fCache);
+
+	size_t pageCount = length / B_PAGE_SIZE;
+	size_t index = 0;
+	size_t missingPages = 0;
+
+	while (length > 0) {
+		vm_page* page = fCache->LookupPage(offset);
+		if (page != NULL) {
+			if (page->busy) {
+				fCache->WaitForPageEvents(page, PAGE_EVENT_NOT_BUSY, true);
+				continue;
+			}
+
+			DEBUG_PAGE_ACCESS_START(page);
+			page->busy = true;
+		} else
+			missingPages++;
+
+		pages[index++] = page;
+		offset += B_PAGE_SIZE;
+		length -= B_PAGE_SIZE;
+	}
+
+	locker.Unlock();
+
+	// For a write we need to reserve the missing pages. Pages of files are
+	// charged to the volume and the owner by the caller once they are in the
+	// cache.
+	if (isWrite && missingPages > 0) {
+		status_t res = owner != NULL ? owner->Volume()->CheckSpace(owner, missingPages, 0) : B_OK;
+		if (res < B_OK) {
+			PutPages(offset - pageCount * B_PAGE_SIZE, pageCount * B_PAGE_SIZE, pages, false);
+			return res;
+		}
+
+		vm_page_reservation reservation;
+		vm_page_reserve_pages(&reservation, missingPages,
+			VM_PRIORITY_SYSTEM);
+
+		for (size_t i = 0; i < pageCount; i++) {
+			if (pages[i] != NULL)
+				continue;
+
+			// cleared, partial writes must not expose old page contents
+			pages[i] = vm_page_allocate_page(&reservation,
+				PAGE_STATE_WIRED | VM_PAGE_ALLOC_BUSY | VM_PAGE_ALLOC_CLEAR);
+
+			if (--missingPages == 0)
+				break;
+		}
+
+		vm_page_unreserve_pages(&reservation);
+	}
+	return B_OK;
+}
+
+void ShmfsPageCache::PutPages(off_t offset, off_t length, vm_page** pages, bool success)
+{
+	// TODO: This method is duplicated in the ram_disk. Perhaps it
+	// should be put into a common location?
+
+	AutoLocker<VMCache> locker(fCache);
+
+	// Mark all pages unbusy. On error free the newly allocated pages.
+	size_t index = 0;
+
+	while (length > 0) {
+		vm_page* page = pages[index++];
+		if (page != NULL) {
+			if (page->CacheRef() == NULL) {
+				if (success) {
+					fCache->InsertPage(page, offset);
+					fCache->MarkPageUnbusy(page);
+					DEBUG_PAGE_ACCESS_END(page);
+				} else
+					vm_page_free(NULL, page);
+			} else {
+				fCache->MarkPageUnbusy(page);
+				DEBUG_PAGE_ACCESS_END(page);
+			}
+		}
+
+		offset += B_PAGE_SIZE;
+		length -= B_PAGE_SIZE;
+	}
+}
@@ -0,0 +1,448 @@
+#include "Shmfs.h"
+
+#include <NodeMonitor.h>
+#include <dirent.h>
+
+#include <ctype.h>
+
+
+static void SkipSpace(const char* &str)
+{
+	while (isspace(*str))
+		str++;
+}
+
+// Matches one character against a [...] class at pattern, next is set to
+// the pattern after the class. An unterminated class is a literal '['.
+static bool MatchClass(const char* pattern, char c, const char* &next)
+{
+	const char* p = pattern + 1;
+	bool negate = *p == '^' || *p == '!';
+	if (negate)
+		p++;
+	bool found = false;
+	for (bool first = true; *p != '\0' && (*p != ']' || first); first = false) {
+		uint8 low = *p, high = *p;
+		if (p[1] == '-' && p[2] != '\0' && p[2] != ']') {
+			high = p[2];
+			p += 3;
+		} else
+			p++;
+		if ((uint8)c >= low && (uint8)c <= high)
+			found = true;
+	}
+	if (*p != ']') {
+		next = pattern + 1;
+		return c == '[';
+	}
+	next = p + 1;
+	return found != negate;
+}
+
+// Glob match without recursion, a '*' backtracks to the last star only.
+static bool GlobMatch(const char* pattern, const char* string, size_t length)
+{
+	const char* p = pattern;
+	size_t s = 0;
+	const char* starPattern = NULL;
+	size_t starString = 0;
+	while (s < length) {
+		if (*p == '*') {
+			starPattern = ++p;
+			starString = s;
+			continue;
+		}
+		if (*p != '\0') {
+			const char* next = p + 1;
+			bool matched;
+			if (*p == '?')
+				matched = true;
+			else if (*p == '[')
+				matched = MatchClass(p, string[s], next);
+			else
+				matched = *p == string[s];
+			if (matched) {
+				p = next;
+				s++;
+				continue;
+			}
+		}
+		if (starPattern == NULL)
+			return false;
+		p = starPattern;
+		s = ++starString;
+	}
+	while (*p == '*')
+		p++;
+	return *p == '\0';
+}
+
+
+//#pragma mark - ShmfsQuery
+
+ShmfsQuery::Term::~Term()
+{
+	while (children != NULL) {
+		Term* child = children;
+		children = child->next;
+		delete child;
+	}
+}
+
+// Attribute names and values are bare words or quoted with " or ', a
+// backslash escapes the next character.
+status_t ShmfsQuery::ParseString(const char* &str, bool isValue, ArrayDeleter<char> &string)
+{
+	SkipSpace(str);
+	char quote = '\0';
+	if (*str == '"' || *str == '\'')
+		quote = *str++;
+
+	ArrayDeleter<char> buffer(new(std::nothrow) char[strlen(str) + 1]);
+	if (!buffer.IsSet())
+		return B_NO_MEMORY;
+	size_t length = 0;
+	for (;;) {
+		char c = *str;
+		if (c == '\0') {
+			if (quote != '\0')
+				return B_BAD_VALUE;
+			break;
+		}
+		if (quote != '\0') {
+			if (c == quote) {
+				str++;
+				break;
+			}
+		} else if (isspace(c) || strchr(isValue ? "()&|" : "()&|=!<>", c) != NULL)
+			break;
+		if (c == '\\' && str[1] != '\0')
+			c = *++str;
+		buffer[length++] = c;
+		str++;
+	}
+	if (length == 0 && quote == '\0')
+		return B_BAD_VALUE;
+	buffer[length] = '\0';
+	string.SetTo(buffer.Detach());
+	return B_OK;
+}
+
+status_t ShmfsQuery::ParseComparison(const char* &str, ObjectDeleter<Term> &term)
+{
+	ObjectDeleter<Term> comparison(new(std::nothrow) Term());
+	if (!comparison.IsSet())
+		return B_NO_MEMORY;
+	CHECK_RET(ParseString(str, false, comparison->attr));
+
+	SkipSpace(str);
+	if (str[0] == '=') {
+		comparison->op = kEqual;
+		str += str[1] == '=' ? 2 : 1;
+	} else if (str[0] == '!' && str[1] == '=') {
+		comparison->op = kNotEqual;
+		str += 2;
+	} else if (str[0] == '<') {
+		comparison->op = str[1] == '=' ? kLessEqual : kLess;
+		str += str[1] == '=' ? 2 : 1;
+	} else if (str[0] == '>') {
+		comparison->op = str[1] == '=' ? kGreaterEqual : kGreater;
+		str += str[1] == '=' ? 2 : 1;
+	} else
+		return B_BAD_VALUE;
+
+	CHECK_RET(ParseString(str, true, comparison->value));
+	comparison->hasWildcard = strpbrk(comparison->value.Get(), "*?[") != NULL;
+
+	// built-in indexes live as long as the volume
+	ShmfsIndex* index = fVolume->FindIndex(comparison->attr.Get());
+	if (index != NULL && index->GetKind() != ShmfsIndex::kAttribute) {
+		comparison->property = index;
+		fProperties |= 1 << index->GetKind();
+	}
+
+	term.SetTo(comparison.Detach());
+	return B_OK;
+}
+
+status_t ShmfsQuery::ParseUnary(const char* &str, int32 depth, ObjectDeleter<Term> &term)
+{
+	if (depth >= kMaxDepth)
+		return B_BAD_VALUE;
+
+	SkipSpace(str);
+	if (str[0] == '!' && str[1] != '=') {
+		str++;
+		ObjectDeleter<Term> operand;
+		CHECK_RET(ParseUnary(str, depth + 1, operand));
+		Term* negation = new(std::nothrow) Term();
+		if (negation == NULL)
+			return B_NO_MEMORY;
+		negation->op = kNot;
+		negation->children = operand.Detach();
+		term.SetTo(negation);
+		return B_OK;
+	}
+	if (str[0] == '(') {
+		str++;
+		CHECK_RET(ParseList(str, depth + 1, kOr, term));
+		SkipSpace(str);
+		if (*str != ')')
+			return B_BAD_VALUE;
+		str++;
+		return B_OK;
+	}
+	return ParseComparison(str, term);
+}
+
+// Parses operands separated by || (op kOr) or && (op kAnd). A single operand
+// is returned as is.
+status_t ShmfsQuery::ParseList(const char* &str, int32 depth, Op op, ObjectDeleter<Term> &term)
+{
+	const char* separator = op == kOr ? "||" : "&&";
+	ObjectDeleter<Term> list;
+	Term* last = NULL;
+	for (;;) {
+		ObjectDeleter<Term> operand;
+		CHECK_RET(op == kOr ? ParseList(str, depth, kAnd, operand) : ParseUnary(str, depth, operand));
+		SkipSpace(str);
+		bool more = strncmp(str, separator, 2) == 0;
+		if (!list.IsSet()) {
+			if (!more) {
+				term.SetTo(operand.Detach());
+				return B_OK;
+			}
+			list.SetTo(new(std::nothrow) Term());
+			if (!list.IsSet())
+				return B_NO_MEMORY;
+			list->op = op;
+		}
+		Term* next = operand.Detach();
+		if (last == NULL)
+			list->children = next;
+		else
+			last->next = next;
+		last = next;
+		if (!more)
+			break;
+		str += 2;
+	}
+	term.SetTo(list.Detach());
+	return B_OK;
+}
+
+bool ShmfsQuery::Compare(Term* term, ShmfsVnode* vnode)
+{
+	uint8 data[ShmfsIndex::kMaxKeyLength];
+	size_t length;
+	uint32 type;
+	if (term->property != NULL) {
+		if (!term->property->GetKey(vnode, data, length))
+			return false;
+		type = term->property->Type();
+	} else {
+		if (!ShmfsIndex::GetAttrKey(vnode, term->attr.Get(), type, data, length))
+			return false;
+		// an indexed attribute of another type is not in the index, a scan
+		// must not find it either
+		ShmfsIndex* index = fVolume->FindIndex(term->attr.Get());
+		if (index != NULL && type != index->Type())
+			return false;
+	}
+
+	if (term->hasWildcard && ShmfsIndex::IsStringType(type) && (term->op == kEqual || term->op == kNotEqual))
+		return GlobMatch(term->value.Get(), (const char*)data, length) == (term->op == kEqual);
+
+	// float and double values are not compared, they would need the FPU
+	uint8 value[ShmfsIndex::kMaxKeyLength];
+	size_t valueLength;
+	if (!ShmfsIndex::ParseKey(type, term->value.Get(), value, valueLength))
+		return false;
+	int cmp = ShmfsIndex::CompareKeys(type, data, length, value, valueLength);
+	switch (term->op) {
+		case kEqual:        return cmp == 0;
+		case kNotEqual:     return cmp != 0;
+		case kLess:         return cmp < 0;
+		case kLessEqual:    return cmp <= 0;
+		case kGreater:      return cmp > 0;
+		case kGreaterEqual: return cmp >= 0;
+		default:            return false;
+	}
+}
+
+bool ShmfsQuery::Evaluate(Term* term, ShmfsVnode* vnode)
+{
+	switch (term->op) {
+		case kAnd:
+			for (Term* child = term->children; child != NULL; child = child->next) {
+				if (!Evaluate(child, vnode))
+					return false;
+			}
+			return true;
+		case kOr:
+			for (Term* child = term->children; child != NULL; child = child->next) {
+				if (Evaluate(child, vnode))
+					return true;
+			}
+			return false;
+		case kNot:
+			return !Evaluate(term->children, vnode);
+		default:
+			return Compare(term, vnode);
+	}
+}
+
+// Returns whether a comparison of the term reads the attribute.
+bool ShmfsQuery::References(Term* term, const char* attr)
+{
+	if (term->op == kAnd || term->op == kOr || term->op == kNot) {
+		for (Term* child = term->children; child != NULL; child = child->next) {
+			if (References(child, attr))
+				return true;
+		}
+		return false;
+	}
+	return term->property == NULL && strcmp(term->attr.Get(), attr) == 0;
+}
+
+bool ShmfsQuery::Matches(ShmfsVnode* vnode)
+{
+	return Evaluate(fRoot.Get(), vnode);
+}
+
+// Finds a comparison every match must satisfy that can be answered from an
+// index, equality is preferred over ranges.
+ShmfsQuery::Term* ShmfsQuery::FindIndexedTerm(Term* term, ShmfsIndex* &index)
+{
+	switch (term->op) {
+		case kAnd: {
+			Term* best = NULL;
+			for (Term* child = term->children; child != NULL; child = child->next) {
+				ShmfsIndex* childIndex;
+				Term* found = FindIndexedTerm(child, childIndex);
+				if (found != NULL && (best == NULL || (found->op == kEqual && best->op != kEqual))) {
+					best = found;
+					index = childIndex;
+				}
+			}
+			return best;
+		}
+		case kOr:
+		case kNot:
+		case kNotEqual:
+			return NULL;
+		default:
+			if (term->hasWildcard)
+				return NULL;
+			index = fVolume->FindIndex(term->attr.Get());
+			return index != NULL ? term : NULL;
+	}
+}
+
+status_t ShmfsQuery::AddResult(ino_t id)
+{
+	if (fResultCount == fResultAlloc) {
+		uint32 newAlloc = fResultAlloc == 0 ? 64 : fResultAlloc * 2;
+		ArrayDeleter<ino_t> newResults(new(std::nothrow) ino_t[newAlloc]);
+		if (!newResults.IsSet())
+			return B_NO_MEMORY;
+		if (fResultCount > 0)
+			memcpy(&newResults[0], &fResults[0], fResultCount * sizeof(ino_t));
+		fResults.SetTo(newResults.Detach());
+		fResultAlloc = newAlloc;
+	}
+	fResults[fResultCount++] = id;
+	return B_OK;
+}
+
+// Scans the range of the best index for candidates, the name index holds
+// all linked nodes if no comparison can use an index.
+status_t ShmfsQuery::Collect()
+{
+	ShmfsIndex* index = NULL;
+	Term* term = FindIndexedTerm(fRoot.Get(), index);
+	uint8 key[ShmfsIndex::kMaxKeyLength];
+	size_t keyLength = 0;
+	if (term != NULL && !ShmfsIndex::ParseKey(index->Type(), term->value.Get(), key, keyLength))
+		term = NULL;
+	if (term == NULL)
+		index = fVolume->NameIndex();
+
+	ShmfsIndex::Entry* entry;
+	if (term == NULL || term->op == kLess || term->op == kLessEqual)
+		entry = index->First();
+	else
+		entry = index->FindFirst(key, keyLength);
+	for (; entry != NULL; entry = index->Next(entry)) {
+		if (term != NULL) {
+			int cmp = ShmfsIndex::CompareKeys(index->Type(), entry->key, entry->keyLength, key, keyLength);
+			if (cmp > 0 && (term->op == kEqual || term->op == kLessEqual))
+				break;
+			if (cmp >= 0 && term->op == kLess)
+				break;
+		}
+		if (Matches(entry->vnode))
+			CHECK_RET(AddResult(entry->vnode->Id()));
+	}
+	return B_OK;
+}
+
+status_t ShmfsQuery::Create(ShmfsVolume* volume, const char* query, uint32 flags, port_id port, uint32 token, ShmfsQuery* &outQuery)
+{
+	if (strnlen(query, kMaxQueryLength + 1) > kMaxQueryLength)
+		return B_BAD_VALUE;
+
+	ObjectDeleter<ShmfsQuery> newQuery(new(std::nothrow) ShmfsQuery(volume, flags, port, token));
+	if (!newQuery.IsSet())
+		return B_NO_MEMORY;
+	const char* str = query;
+	CHECK_RET(newQuery->ParseList(str, 0, kOr, newQuery->fRoot));
+	SkipSpace(str);
+	if (*str != '\0')
+		return B_BAD_VALUE;
+	CHECK_RET(newQuery->Collect());
+
+	outQuery = newQuery.Detach();
+	return B_OK;
+}
+
+void ShmfsQuery::NotifyEntry(ShmfsVnode* vnode, bool created)
+{
+	if (created)
+		notify_query_entry_created(fPort, fToken, fVolume->Id(), vnode->fParent->Id(), vnode->Name(), vnode->Id());
+	else
+		notify_query_entry_removed(fPort, fToken, fVolume->Id(), vnode->fParent->Id(), vnode->Name(), vnode->Id());
+}
+
+status_t ShmfsQuery::Read(struct dirent* buffer, size_t bufferSize, uint32 &num)
+{
+	uint32 maxNum = num;
+	num = 0;
+	for (; num < maxNum && fPos < fResultCount; fPos++) {
+		// the node may have been removed or changed since the query was opened
+		ShmfsVnode* vnode = fVolume->fIds.Find(fResults[fPos]);
+		if (vnode == NULL || vnode->fParent == NULL || !Matches(vnode))
+			continue;
+
+		const char* name = vnode->Name();
+		size_t nameLen = strlen(name) + 1;
+		size_t direntSize = offsetof(struct dirent, d_name) + nameLen;
+		if (bufferSize < direntSize) {
+			if (num == 0)
+				return B_BUFFER_OVERFLOW;
+			break;
+		}
+		*buffer = {
+			.d_dev = fVolume->Id(),
+			.d_pdev = fVolume->Id(),
+			.d_ino = vnode->Id(),
+			.d_pino = vnode->fParent->Id(),
+			.d_reclen = (uint16)direntSize
+		};
+		memcpy(buffer->d_name, name, nameLen);
+		bufferSize -= direntSize;
+		*(uint8**)&buffer += direntSize;
+		num++;
+	}
+	return B_OK;
+}
@@ -9,27 +9,20 @@
 #include <algorithm>
 
 
-status_t ShmfsSymlinkVnode::SetPath(const char *path)
+status_t ShmfsSymlinkVnode::SetPath(const char* path)
 {
-	size_t len = strlen(path) + 1;
-	ArrayDeleter<char> newPath(new(std::nothrow) char[len]);
-	if (!newPath.IsSet())
-		return B_NO_MEMORY;
-	memcpy(&newPath[0], path, len);
-	fPath.SetTo(newPath.Detach());
-	return B_OK;
+	return fPath.SetTo(Volume()->NamePool(), path);
 }
 
 
 //#pragma mark - VFS interface
 
-status_t ShmfsSymlinkVnode::ReadStat(struct stat &stat)
+void ShmfsSymlinkVnode::FillStat(struct stat &stat)
 {
-	RecursiveLocker lock(Volume()->Lock());
-	CHECK_RET(ShmfsVnode::ReadStat(stat));
+	// the path is set before the node is linked and never changes
+	ShmfsVnode::FillStat(stat);
 	stat.st_mode |= S_IFLNK;
 	stat.st_size = strlen(GetPath());
-	return B_OK;
 }
 
 status_t ShmfsSymlinkVnode::ReadSymlink(char* buffer, size_t &bufferSize)
@@ -0,0 +1,110 @@
+#include "Shmfs.h"
+
+#include <KernelExport.h>
+#include <kernel.h>
+#include <smp.h>
+#include <util/AutoLock.h>
+
+
+//#pragma mark - ShmfsUnitCache
+
+ShmfsUnitCache::~ShmfsUnitCache()
+{
+	// the cached units are discarded with the allocator
+	mutex_destroy(&fLock);
+}
+
+status_t ShmfsUnitCache::Init()
+{
+	fMagazineCount = smp_get_num_cpus();
+	// new[] only aligns to 8 bytes, magazines of two CPUs must not share a
+	// cache line
+	fMagazineData.SetTo(new(std::nothrow) uint8[fMagazineCount * sizeof(Magazine) + kCacheLineSize - 1]);
+	if (!fMagazineData.IsSet())
+		return B_NO_MEMORY;
+	fMagazines = (Magazine*)ROUNDUP((addr_t)&fMagazineData[0], kCacheLineSize);
+	for (int32 i = 0; i < fMagazineCount; i++)
+		fMagazines[i].count = 0;
+	return B_OK;
+}
+
+void ShmfsUnitCache::Register(uint64_t ptr, uint64_t size)
+{
+	MutexLocker lock(&fLock);
+	fAllocator.Register(ptr, size);
+}
+
+bool ShmfsUnitCache::Alloc(uint64_t &unit)
+{
+	cpu_status state = disable_interrupts();
+	Magazine &magazine = fMagazines[smp_get_current_cpu()];
+	if (magazine.count > 0) {
+		unit = magazine.units[--magazine.count];
+		restore_interrupts(state);
+		return true;
+	}
+	restore_interrupts(state);
+	return Refill(unit);
+}
+
+void ShmfsUnitCache::Free(uint64_t unit)
+{
+	cpu_status state = disable_interrupts();
+	Magazine &magazine = fMagazines[smp_get_current_cpu()];
+	if (magazine.count < kMagazineSize) {
+		magazine.units[magazine.count++] = unit;
+		restore_interrupts(state);
+		return;
+	}
+	restore_interrupts(state);
+	Drain(unit);
+}
+
+// Returns the first unit of a batch and caches the others. The allocator may
+// allocate memory, so it is never called with interrupts disabled.
+bool ShmfsUnitCache::Refill(uint64_t &unit)
+{
+	uint64_t units[kBatch];
+	uint32 count = kBatch;
+	{
+		MutexLocker lock(&fLock);
+		if (!fAllocator.AllocMany(units, kBatch, 1)) {
+			// nearly exhausted, don't hoard the rest
+			if (!fAllocator.Alloc(units[0], 1))
+				return false;
+			count = 1;
+		}
+	}
+	unit = units[0];
+
+	// the thread may have moved to another CPU or the magazine may have been
+	// refilled meanwhile, whatever does not fit goes back
+	cpu_status state = disable_interrupts();
+	Magazine &magazine = fMagazines[smp_get_current_cpu()];
+	while (count > 1 && magazine.count < kMagazineSize)
+		magazine.units[magazine.count++] = units[--count];
+	restore_interrupts(state);
+
+	if (count > 1) {
+		MutexLocker lock(&fLock);
+		fAllocator.FreeMany(&units[1], count - 1);
+	}
+	return true;
+}
+
+// Frees unit together with the top half of the full magazine.
+void ShmfsUnitCache::Drain(uint64_t unit)
+{
+	uint64_t units[kBatch + 1];
+	uint32 count = 0;
+	units[count++] = unit;
+
+	cpu_status state = disable_interrupts();
+	Magazine &magazine = fMagazines[smp_get_current_cpu()];
+	while (count <= (uint32)kBatch && magazine.count > 0)
+		units[count++] = magazine.units[--magazine.count];
+	restore_interrupts(state);
+
+	MutexLocker lock(&fLock);
+	fAllocator.FreeMany(units, count);
+}
@@ -3,16 +3,105 @@
 #include <NodeMonitor.h>
 #include <dirent.h>
 
+#include <kernel.h>
+#include <cpu.h>
+#include <arch/atomic.h>
 #include <util/AutoLock.h>
 
 #include <new>
+#include <algorithm>
 
 
-void GetCurrentTime(struct timespec &outTime)
+// Timestamps come from a coarse clock that is advanced by a periodic timer,
+// so file operations don't need to read the real time clock.
+static const bigtime_t kClockTick = 10000;
+static shmfs_time sCoarseTime;
+static timer sClockTimer;
+
+static int32 ClockTimerHook(timer* timer)
 {
-	bigtime_t now = real_time_clock_usecs();
-	outTime.tv_sec = now / 1000000LL;
-	outTime.tv_nsec = (now % 1000000LL) * 1000;
+	atomic_set64(&sCoarseTime, real_time_clock_usecs() * 1000);
+	return B_HANDLED_INTERRUPT;
+}
+
+status_t ShmfsInitClock()
+{
+	atomic_set64(&sCoarseTime, real_time_clock_usecs() * 1000);
+	return add_timer(&sClockTimer, ClockTimerHook, kClockTick, B_PERIODIC_TIMER);
+}
+
+void ShmfsUninitClock()
+{
+	cancel_timer(&sClockTimer);
+}
+
+shmfs_time GetCurrentTime()
+{
+	return atomic_get64(&sCoarseTime);
+}
+
+status_t CopyFromIoctlBuffer(void* dst, const void* src, size_t size)
+{
+	return CopyFromIoctlBuffer(dst, src, size, IS_USER_ADDRESS(src));
+}
+
+status_t CopyToIoctlBuffer(void* dst, const void* src, size_t size)
+{
+	return CopyToIoctlBuffer(dst, src, size, IS_USER_ADDRESS(dst));
+}
+
+status_t CopyStringFromIoctlBuffer(char* dst, const char* src, size_t size)
+{
+	return CopyStringFromIoctlBuffer(dst, src, size, IS_USER_ADDRESS(src));
+}
+
+status_t CopyFromIoctlBuffer(void* dst, const void* src, size_t size, bool user)
+{
+	if (src == NULL)
+		return B_BAD_VALUE;
+	if (user)
+		return user_memcpy(dst, src, size);
+	memcpy(dst, src, size);
+	return B_OK;
+}
+
+status_t CopyToIoctlBuffer(void* dst, const void* src, size_t size, bool user)
+{
+	if (dst == NULL)
+		return B_BAD_VALUE;
+	if (user)
+		return user_memcpy(dst, src, size);
+	memcpy(dst, src, size);
+	return B_OK;
+}
+
+status_t CopyStringFromIoctlBuffer(char* dst, const char* src, size_t size, bool user)
+{
+	if (src == NULL)
+		return B_BAD_VALUE;
+	ssize_t len;
+	if (user)
+		len = user_strlcpy(dst, src, size);
+	else
+		len = strlcpy(dst, src, size);
+	if (len < 0)
+		return len;
+	if ((size_t)len >= size)
+		return B_NAME_TOO_LONG;
+	return B_OK;
+}
+
+// Tells whether all of [address, address + size) is user space, user space
+// is contiguous so checking both ends is enough.
+bool IsUserRange(const void* address, uint64 size)
+{
+	addr_t start = (addr_t)address;
+	if (!IS_USER_ADDRESS(start))
+		return false;
+	if (size == 0)
+		return true;
+	addr_t last = start + (addr_t)(size - 1);
+	return size - 1 <= (uint64)~(addr_t)0 && last >= start && IS_USER_ADDRESS(last);
 }
 
 
@@ -20,59 +109,226 @@ void GetCurrentTime(struct timespec &outTime)
 
 ShmfsVnode::~ShmfsVnode()
 {
-	RecursiveLocker lock(Volume()->Lock());
 	TRACE("-ShmfsVnode(%" B_PRId64 ", \"%s\")\n", fId, Name());
-	for (;;) {
-		ShmfsAttribute *attr = fAttrs.LeftMost();
-		if (attr == NULL)
-			break;
-		fAttrs.Remove(attr);
-		attr->ReleaseReference();
+	if (fAttrs.IsSet()) {
+		for (;;) {
+			ShmfsAttribute *attr = fAttrs->attrs.LeftMost();
+			if (attr == NULL)
+				break;
+			fAttrs->attrs.Remove(attr);
+			attr->SetOwner(NULL);
+			attr->ReleaseReference();
+		}
 	}
-	if (fId != 0) {
-		fVolume->fIds.Remove(this);
+	// on unmount the id map and pool are discarded as a whole
+	if (fId != 0 && !fVolume->fUnmounting) {
+		if (fIdMapped) {
+			RecursiveLocker lock(Volume()->Lock());
+			fVolume->UnmapVnode(this);
+		}
+		fVolume->AddUsage(this, 0, -1);
 		fVolume->fIdPool.Free(fId);
 	}
 }
 
+// Frozen nodes never change again, so readers that see the flag may access
+// them without the volume lock.
+bool ShmfsVnode::IsFrozen()
+{
+	if (!fFrozen)
+		return false;
+	memory_read_barrier();
+	return true;
+}
+
+// Applies the access time policy of the volume to a read access. Returns
+// whether the access time was changed. Called with the volume lock held.
+bool ShmfsVnode::TouchAccessTime()
+{
+	if (IsFrozen())
+		return false;
+	shmfs_time time = GetCurrentTime();
+	switch (Volume()->GetAtimeMode()) {
+		case ShmfsVolume::kAtimeNone:
+			return false;
+		case ShmfsVolume::kAtimeRelative:
+			// only once per day unless the node changed since the last access
+			if (fAccessTime > fModifyTime && fAccessTime > fChangeTime
+				&& time - fAccessTime < 24 * 3600 * 1000000000LL) {
+				return false;
+			}
+			break;
+		case ShmfsVolume::kAtimeStrict:
+			break;
+	}
+	if (fAccessTime == time)
+		return false;
+	BeginStatChange();
+	fAccessTime = time;
+	EndStatChange();
+	return true;
+}
+
 status_t ShmfsVnode::SetName(const char *name)
 {
-	size_t len = strlen(name) + 1;
-	ArrayDeleter<char> newName(new(std::nothrow) char[len]);
-	if (!newName.IsSet())
-		return B_NO_MEMORY;
-	memcpy(&newName[0], name, len);
-	fName.SetTo(newName.Detach());
+	return fName.SetTo(Volume()->NamePool(), name);
+}
+
+status_t ShmfsVnode::EnsureAttrs()
+{
+	if (!fAttrs.IsSet()) {
+		fAttrs.SetTo(new(std::nothrow) ShmfsVnodeAttrs());
+		if (!fAttrs.IsSet())
+			return B_NO_MEMORY;
+	}
 	return B_OK;
 }
 
 
-void ShmfsVnode::AttrIteratorRewind(ShmfsAttrDirIterator* cookie)
+// Called with the volume lock held after the node was unlinked. Nodes that
+// are loaded by the VFS are deleted once the VFS drops them.
+void ShmfsVnode::RemoveFromVfs()
 {
-	cookie->attr = fAttrs.LeftMost();
+	if (acquire_vnode(Volume()->Base(), Id()) >= B_OK) {
+		remove_vnode(Volume()->Base(), Id());
+		put_vnode(Volume()->Base(), Id());
+	}
 }
 
-bool ShmfsVnode::AttrIteratorGet(ShmfsAttrDirIterator* cookie, const char *&name, ShmfsAttribute *&attr)
+
+// Returns false if the node has no attribute state yet, an unregistered
+// iterator stays at the start.
+bool ShmfsVnode::RegisterAttrIterator(ShmfsAttrDirIterator* cookie)
 {
-		if (cookie->attr == NULL)
-			return false;
-		attr = cookie->attr;
-		name = attr->Name();
+	if (cookie->registered)
 		return true;
+	if (!fAttrs.IsSet())
+		return false;
+	fAttrs->iterators.Insert(cookie);
+	cookie->registered = true;
+	return true;
+}
+
+void ShmfsVnode::AttrIteratorRewind(ShmfsAttrDirIterator* cookie)
+{
+	cookie->smallPos = 0;
+	cookie->inLarge = false;
+	cookie->attr = NULL;
+}
+
+bool ShmfsVnode::AttrIteratorGet(ShmfsAttrDirIterator* cookie, const char *&name)
+{
+	if (!cookie->inLarge) {
+		if (cookie->smallPos < fAttrs->smallDataSize) {
+			name = fAttrs->SmallDataAt(cookie->smallPos)->Name();
+			return true;
+		}
+		cookie->inLarge = true;
+		cookie->attr = fAttrs->attrs.LeftMost();
+	}
+	if (cookie->attr == NULL)
+		return false;
+	name = cookie->attr->Name();
+	return true;
 }
 
 void ShmfsVnode::AttrIteratorNext(ShmfsAttrDirIterator* cookie)
 {
-		cookie->attr = fAttrs.Next(cookie->attr);
+	if (!cookie->inLarge)
+		cookie->smallPos += fAttrs->SmallDataAt(cookie->smallPos)->RecordSize();
+	else
+		cookie->attr = fAttrs->attrs.Next(cookie->attr);
 }
 
 void ShmfsVnode::RemoveAttr(ShmfsAttribute *attr)
 {
-	for (ShmfsAttrDirIterator *it = fAttrIterators.First(); it != NULL; it = fAttrIterators.GetNext(it)) {
-		if (it->attr == attr)
+	for (ShmfsAttrDirIterator *it = fAttrs->iterators.First(); it != NULL; it = fAttrs->iterators.GetNext(it)) {
+		if (it->inLarge && it->attr == attr)
 			AttrIteratorNext(it);
 	}
-	fAttrs.Remove(attr);
+	fAttrs->attrs.Remove(attr);
+}
+
+bool ShmfsVnode::LookupAttr(const char* name, ShmfsSmallData* &small, ShmfsAttribute* &large)
+{
+	small = NULL;
+	large = NULL;
+	if (!fAttrs.IsSet())
+		return false;
+	small = fAttrs->FindSmallData(name);
+	if (small == NULL)
+		large = fAttrs->attrs.Find(name);
+	return small != NULL || large != NULL;
+}
+
+// Adds a new attribute, packed into the small data area if it fits.
+status_t ShmfsVnode::AddAttr(const char* name, uint32 type, const void* data, size_t size)
+{
+	CHECK_RET(EnsureAttrs());
+	if (size <= ShmfsVnodeAttrs::kMaxSmallDataSize) {
+		ShmfsSmallData* small;
+		status_t res = fAttrs->AddSmallData(name, type, data, (uint32)size, small);
+		if (res != B_DEVICE_FULL)
+			return res;
+	}
+	BReference<ShmfsAttribute> attr(new(std::nothrow) ShmfsAttribute(), true);
+	if (!attr.IsSet())
+		return B_NO_MEMORY;
+	CHECK_RET(attr->SetName(Volume()->NamePool(), name));
+	CHECK_RET(attr->SetOwner(this));
+	attr->fType = type;
+	CHECK_RET(attr->Write(0, data, size));
+	fAttrs->attrs.Insert(attr.Detach());
+	return B_OK;
+}
+
+// Resizes an attribute value, a small value that outgrows the small data
+// area is moved to a separate attribute.
+status_t ShmfsVnode::ResizeAttr(ShmfsSmallData* &small, ShmfsAttribute* &large, off_t size)
+{
+	if (size < 0)
+		return B_BAD_VALUE;
+	if (large != NULL)
+		return large->WriteStat({.st_size = size}, B_STAT_SIZE);
+	if (size <= ShmfsVnodeAttrs::kMaxSmallDataSize) {
+		status_t res = fAttrs->ResizeSmallData(small, (uint32)size);
+		if (res != B_DEVICE_FULL)
+			return res;
+	}
+
+	BReference<ShmfsAttribute> attr(new(std::nothrow) ShmfsAttribute(), true);
+	if (!attr.IsSet())
+		return B_NO_MEMORY;
+	CHECK_RET(attr->SetName(Volume()->NamePool(), small->Name()));
+	CHECK_RET(attr->SetOwner(this));
+	attr->fType = small->type;
+	size_t length = small->dataSize;
+	CHECK_RET(attr->Write(0, small->Data(), length));
+	CHECK_RET(attr->WriteStat({.st_size = size}, B_STAT_SIZE));
+	fAttrs->RemoveSmallData(small);
+	small = NULL;
+	large = attr.Detach();
+	fAttrs->attrs.Insert(large);
+	return B_OK;
+}
+
+// Reads the start of an attribute value with the volume lock held, returns
+// false if there is no such attribute.
+bool ShmfsVnode::ReadAttrValue(const char* name, uint32 &type, void* buffer, size_t &length)
+{
+	ShmfsSmallData* small;
+	ShmfsAttribute* large;
+	if (!LookupAttr(name, small, large))
+		return false;
+	if (small != NULL) {
+		type = small->type;
+		length = std::min<size_t>(length, small->dataSize);
+		memcpy(buffer, small->Data(), length);
+	} else {
+		type = large->fType;
+		large->Read(0, buffer, length);
+	}
+	return true;
 }
 
 
@@ -106,8 +362,34 @@ status_t ShmfsVnode::RemoveVnode(bool reenter)
 	return B_OK;
 }
 
-status_t ShmfsVnode::Ioctl(ShmfsFileCookie* cookie, uint32 op, void* buffer, size_t length)
+void ShmfsVnode::GetUsage(shmfs_usage &usage)
+{
+	usage = {.bytes = 0, .pages = 0, .nodes = 1};
+}
+
+status_t ShmfsVnode::Ioctl(void* cookie, uint32 op, void* buffer, size_t length)
 {
+	switch (op) {
+		case SHMFS_IOCTL_GET_QUOTA:
+		case SHMFS_IOCTL_SET_QUOTA: {
+			shmfs_quota quota;
+			CHECK_RET(CopyFromIoctlBuffer(&quota, buffer, sizeof(quota)));
+			CHECK_RET(op == SHMFS_IOCTL_GET_QUOTA ? Volume()->GetQuota(quota) : Volume()->SetQuota(quota));
+			return CopyToIoctlBuffer(buffer, &quota, sizeof(quota));
+		}
+		case SHMFS_IOCTL_GET_USAGE: {
+			shmfs_usage usage;
+			{
+				RecursiveLocker lock(Volume()->Lock());
+				GetUsage(usage);
+			}
+			return CopyToIoctlBuffer(buffer, &usage, sizeof(usage));
+		}
+		case SHMFS_IOCTL_READ_ATTRS:
+			return ReadAttrs(buffer, length);
+		case SHMFS_IOCTL_WRITE_ATTRS:
+			return WriteAttrs(buffer);
+	}
 	return B_DEV_INVALID_IOCTL;
 }
 
@@ -151,23 +433,38 @@ status_t ShmfsVnode::Access(int mode)
 	return B_OK;
 }
 
-status_t ShmfsVnode::ReadStat(struct stat &stat)
+void ShmfsVnode::FillStat(struct stat &stat)
 {
-	RecursiveLocker lock(Volume()->Lock());
-	TRACE("ShmfsVnode::ReadStat()\n");
-
 	stat = {
 		.st_ino = fId,
 		.st_mode = fMode,
 		.st_nlink = 1,
 		.st_uid = fUid,
 		.st_gid = fGid,
-		.st_atim = fAccessTime,
-		.st_mtim = fModifyTime,
-		.st_ctim = fChangeTime,
-		.st_crtim = fCreateTime,
+		.st_atim = ToTimespec(fAccessTime),
+		.st_mtim = ToTimespec(fModifyTime),
+		.st_ctim = ToTimespec(fChangeTime),
+		.st_crtim = ToTimespec(fCreateTime),
 	};
-	return B_OK;
+}
+
+// Copies the stat fields without locking and retries if a writer changed
+// them meanwhile.
+status_t ShmfsVnode::ReadStat(struct stat &stat)
+{
+	TRACE("ShmfsVnode::ReadStat()\n");
+	for (;;) {
+		int32 seq = atomic_get(&fStatSeq);
+		if ((seq & 1) == 0) {
+			// the fields must not be loaded before the sequence
+			memory_read_barrier();
+			FillStat(stat);
+			memory_read_barrier();
+			if (atomic_get(&fStatSeq) == seq)
+				return B_OK;
+		}
+		cpu_pause();
+	}
 }
 
 status_t ShmfsVnode::WriteStat(const struct stat &stat, uint32 statMask)
@@ -177,22 +474,52 @@ status_t ShmfsVnode::WriteStat(const struct stat &stat, uint32 statMask)
 	RecursiveLocker lock(Volume()->Lock());
 	TRACE("ShmfsVnode::WriteStat()\n");
 
+	if (IsFrozen())
+		return B_NOT_ALLOWED;
+
+	// The charges of the node move to the new owner. Quota entries may have
+	// to be allocated, that is done before lock-free readers have to wait.
+	const bool changeOwner = (statMask & (B_STAT_UID | B_STAT_GID)) != 0;
+	uid_t uid = (statMask & B_STAT_UID) != 0 ? stat.st_uid : fUid;
+	gid_t gid = (statMask & B_STAT_GID) != 0 ? stat.st_gid : fGid;
+	ShmfsQuota* userQuota = fUserQuota;
+	ShmfsQuota* groupQuota = fGroupQuota;
+	int64 pages = 0;
+	if (changeOwner) {
+		CHECK_RET(Volume()->LookupQuotas(uid, gid, userQuota, groupQuota));
+		pages = fType == kFile ? static_cast<ShmfsFileVnode*>(this)->UsedPages() : 0;
+		if (fAttrs.IsSet() && fAttrs->attrs.LeftMost() != NULL) {
+			// attribute pages don't change while no writer runs unlocked
+			Volume()->WaitForAttrWriters();
+			for (ShmfsAttribute* attr = fAttrs->attrs.LeftMost(); attr != NULL; attr = fAttrs->attrs.Next(attr))
+				pages += attr->ChargedPages();
+		}
+		Volume()->AddUsage(this, -pages, -1);
+	}
+
+	BeginStatChange();
 	if ((statMask & B_STAT_MODE) != 0)
 		fMode = stat.st_mode & S_IUMSK;
-	if ((statMask & B_STAT_UID) != 0)
-		fUid = stat.st_uid;
-	if ((statMask & B_STAT_GID) != 0)
-		fGid = stat.st_gid;
+	if (changeOwner) {
+		fUid = uid;
+		fGid = gid;
+		fUserQuota = userQuota;
+		fGroupQuota = groupQuota;
+	}
 	if ((statMask & B_STAT_ACCESS_TIME) != 0)
-		fAccessTime = stat.st_atim;
+		fAccessTime = ToShmfsTime(stat.st_atim);
 	if ((statMask & B_STAT_MODIFICATION_TIME) != 0)
-		fModifyTime = stat.st_mtim;
+		fModifyTime = ToShmfsTime(stat.st_mtim);
 	if ((statMask & B_STAT_CHANGE_TIME) != 0)
-		fChangeTime = stat.st_ctim;
+		fChangeTime = ToShmfsTime(stat.st_ctim);
 	else if (statMask != 0)
-		GetCurrentTime(fChangeTime);
+		fChangeTime = GetCurrentTime();
 	if ((statMask & B_STAT_CREATION_TIME) != 0)
-		fCreateTime = stat.st_crtim;
+		fCreateTime = ToShmfsTime(stat.st_crtim);
+	EndStatChange();
+
+	if (changeOwner)
+		Volume()->AddUsage(this, pages, 1);
 
 	dirId = fParent == NULL ? 0 : fParent->Id();
 	}
@@ -283,21 +610,25 @@ status_t ShmfsVnode::RewindDir(ShmfsDirIterator* cookie)
 
 //#pragma mark - Attributes
 
+// Listing the attributes of a node without any doesn't allocate attribute
+// state, the iterator is registered once the node has some.
 status_t ShmfsVnode::OpenAttrDir(ShmfsAttrDirIterator* &cookie)
 {
 	RecursiveLocker lock(Volume()->Lock());
 	cookie = new (std::nothrow) ShmfsAttrDirIterator();
 	if (cookie == NULL)
 		return B_NO_MEMORY;
-	fAttrIterators.Insert(cookie);
-	RewindAttrDir(cookie);
+	AttrIteratorRewind(cookie);
+	RegisterAttrIterator(cookie);
 	return B_OK;
 }
 
 status_t ShmfsVnode::CloseAttrDir(ShmfsAttrDirIterator* cookie)
 {
 	RecursiveLocker lock(Volume()->Lock());
-	fAttrIterators.Remove(cookie);
+	if (cookie->registered)
+		fAttrs->iterators.Remove(cookie);
+	cookie->registered = false;
 	return B_OK;
 }
 
@@ -312,15 +643,16 @@ status_t ShmfsVnode::ReadAttrDir(ShmfsAttrDirIterator* cookie, struct dirent* bu
 	RecursiveLocker lock(Volume()->Lock());
 
 	const char *name;
-	ShmfsAttribute *attr;
 	uint32 maxNum = num;
 	num = 0;
+	if (!RegisterAttrIterator(cookie))
+		return B_OK;
 
 	for (;;) {
 		if (!(num < maxNum))
 			break;
 
-		if (!AttrIteratorGet(cookie, name, attr))
+		if (!AttrIteratorGet(cookie, name))
 			break;
 
 		size_t direntSize = offsetof(struct dirent, d_name) + strlen(name) + 1;
@@ -351,88 +683,203 @@ status_t ShmfsVnode::RewindAttrDir(ShmfsAttrDirIterator* cookie)
 	return B_OK;
 }
 
-status_t ShmfsVnode::CreateAttr(const char* name, uint32 type, int openMode, ShmfsAttribute* &cookie)
+status_t ShmfsVnode::CreateAttr(const char* name, uint32 type, int openMode, ShmfsAttrCookie* &cookie)
 {
 	RecursiveLocker lock(Volume()->Lock());
-	ShmfsAttribute *oldAttr = fAttrs.Find(name);
-	if (oldAttr != NULL) {
+	if (IsFrozen())
+		return B_NOT_ALLOWED;
+	ObjectDeleter<ShmfsAttrCookie> newCookie(new(std::nothrow) ShmfsAttrCookie());
+	if (!newCookie.IsSet())
+		return B_NO_MEMORY;
+	CHECK_RET(Volume()->NamePool()->Acquire(name, newCookie->name));
+	newCookie->openMode = openMode;
+
+	ShmfsIndexUpdate indexUpdate(this, name);
+	ShmfsSmallData* small;
+	ShmfsAttribute* large;
+	if (LookupAttr(name, small, large)) {
 		if ((O_EXCL & openMode) != 0)
 			return B_FILE_EXISTS;
 		if ((O_TRUNC & openMode) != 0)
-			CHECK_RET(oldAttr->WriteStat({.st_size = 0}, B_STAT_SIZE));
-		oldAttr->AcquireReference();
-		cookie = oldAttr;
-		return B_OK;
-	}
-	BReference<ShmfsAttribute> attr(new(std::nothrow) ShmfsAttribute(), true);
-	if (!attr.IsSet())
-		return B_NO_MEMORY;
-	CHECK_RET(attr->SetName(name));
-	attr->fType = type;
-	fAttrs.Insert(attr);
-	attr->AcquireReference();
-	cookie = attr.Detach();
+			CHECK_RET(ResizeAttr(small, large, 0));
+	} else
+		CHECK_RET(AddAttr(name, type, NULL, 0));
+	cookie = newCookie.Detach();
 	return B_OK;
 }
 
-status_t ShmfsVnode::OpenAttr(const char* name, int openMode, ShmfsAttribute* &cookie)
+status_t ShmfsVnode::OpenAttr(const char* name, int openMode, ShmfsAttrCookie* &cookie)
 {
-	RecursiveLocker lock(Volume()->Lock());
-	ShmfsAttribute *attr = fAttrs.Find(name);
-	if (attr == NULL)
+	RecursiveLocker lock(Volume()->Lock(), false, !IsFrozen());
+	ShmfsSmallData* small;
+	ShmfsAttribute* large;
+	if (!LookupAttr(name, small, large))
 		return B_ENTRY_NOT_FOUND;
-	attr->AcquireReference();
-	cookie = attr;
+	ObjectDeleter<ShmfsAttrCookie> newCookie(new(std::nothrow) ShmfsAttrCookie());
+	if (!newCookie.IsSet())
+		return B_NO_MEMORY;
+	CHECK_RET(Volume()->NamePool()->Acquire(name, newCookie->name));
+	newCookie->openMode = openMode;
+	cookie = newCookie.Detach();
 	return B_OK;
 }
 
-status_t ShmfsVnode::CloseAttr(ShmfsAttribute* cookie)
+status_t ShmfsVnode::CloseAttr(ShmfsAttrCookie* cookie)
 {
 	return B_OK;
 }
 
-status_t ShmfsVnode::FreeAttrCookie(ShmfsAttribute* cookie)
+status_t ShmfsVnode::FreeAttrCookie(ShmfsAttrCookie* cookie)
 {
-	cookie->ReleaseReference();
+	delete cookie;
 	return B_OK;
 }
 
-status_t ShmfsVnode::ReadAttr(ShmfsAttribute* cookie, off_t pos, void* buffer, size_t &length)
+// The volume lock is only held for the lookup. Small values are copied out
+// with it, large ones are read afterwards, see ShmfsAttribute::Read().
+status_t ShmfsVnode::ReadAttr(ShmfsAttrCookie* cookie, off_t pos, void* buffer, size_t &length)
 {
-	return cookie->Read(pos, buffer, length);
+	if (pos < 0)
+		return B_BAD_VALUE;
+	uint8 data[ShmfsVnodeAttrs::kMaxSmallDataSize];
+	BReference<ShmfsAttribute> attr;
+	{
+		RecursiveLocker lock(Volume()->Lock(), false, !IsFrozen());
+		ShmfsSmallData* small;
+		ShmfsAttribute* large;
+		if (!LookupAttr(cookie->Name(), small, large))
+			return B_ENTRY_NOT_FOUND;
+		if (large != NULL)
+			attr.SetTo(large);
+		else {
+			pos = std::min<off_t>(pos, small->dataSize);
+			length = std::min<size_t>(length, size_t(small->dataSize - pos));
+			memcpy(data, small->Data() + pos, length);
+		}
+	}
+	if (attr.IsSet())
+		return attr->Read(pos, buffer, length);
+	if (length == 0)
+		return B_OK;
+	return CopyToIoctlBuffer(buffer, data, length);
 }
 
-status_t ShmfsVnode::WriteAttr(ShmfsAttribute* cookie, off_t pos, const void* buffer, size_t &length)
+status_t ShmfsVnode::WriteAttr(ShmfsAttrCookie* cookie, off_t pos, const void* buffer, size_t &length)
 {
-	return cookie->Write(pos, buffer, length);
+	RecursiveLocker lock(Volume()->Lock());
+	if (IsFrozen())
+		return B_NOT_ALLOWED;
+	if (pos < 0)
+		return B_BAD_VALUE;
+	if (length == 0)
+		return B_OK;
+
+	ShmfsSmallData* small;
+	ShmfsAttribute* large;
+	if (!LookupAttr(cookie->Name(), small, large))
+		return B_ENTRY_NOT_FOUND;
+	if (large != NULL && !Volume()->AttrChangesObserved()) {
+		// no index or live query looks at the value, only writers of the
+		// same attribute are excluded
+		BReference<ShmfsAttribute> attr(large);
+		ReadLocker writerLocker(Volume()->AttrWriterLock());
+		lock.Unlock();
+		return attr->Write(pos, buffer, length);
+	}
+
+	ShmfsIndexUpdate indexUpdate(this, cookie->Name());
+	off_t newSize = pos + length;
+	if (newSize > (small != NULL ? (off_t)small->dataSize : (off_t)large->Size()))
+		CHECK_RET(ResizeAttr(small, large, newSize));
+	if (large != NULL)
+		return large->Write(pos, buffer, length);
+	return CopyFromIoctlBuffer(small->Data() + pos, buffer, length);
 }
 
-status_t ShmfsVnode::ReadAttrStat(ShmfsAttribute* cookie, struct stat &stat)
+status_t ShmfsVnode::ReadAttrStat(ShmfsAttrCookie* cookie, struct stat &stat)
 {
-	return cookie->ReadStat(stat);
+	RecursiveLocker lock(Volume()->Lock(), false, !IsFrozen());
+	ShmfsSmallData* small;
+	ShmfsAttribute* large;
+	if (!LookupAttr(cookie->Name(), small, large))
+		return B_ENTRY_NOT_FOUND;
+	if (large != NULL)
+		return large->ReadStat(stat);
+	stat.st_mode = S_ATTR;
+	stat.st_size = small->dataSize;
+	stat.st_type = small->type;
+	return B_OK;
 }
 
-status_t ShmfsVnode::WriteAttrStat(ShmfsAttribute* cookie, const struct stat &stat, int statMask)
+status_t ShmfsVnode::WriteAttrStat(ShmfsAttrCookie* cookie, const struct stat &stat, int statMask)
 {
-	return cookie->WriteStat(stat, statMask);
+	RecursiveLocker lock(Volume()->Lock());
+	if (IsFrozen())
+		return B_NOT_ALLOWED;
+	ShmfsIndexUpdate indexUpdate(this, cookie->Name());
+	ShmfsSmallData* small;
+	ShmfsAttribute* large;
+	if (!LookupAttr(cookie->Name(), small, large))
+		return B_ENTRY_NOT_FOUND;
+	if ((statMask & B_STAT_SIZE) != 0)
+		CHECK_RET(ResizeAttr(small, large, stat.st_size));
+	return B_OK;
 }
 
 status_t ShmfsVnode::RenameAttr(const char* fromName, ShmfsVnode* toVnode, const char* toName)
 {
 	RecursiveLocker lock(Volume()->Lock());
 
-	ShmfsAttribute *attr = fAttrs.Find(fromName);
-	if (attr == NULL)
+	if (IsFrozen() || toVnode->IsFrozen())
+		return B_NOT_ALLOWED;
+
+	ShmfsSmallData* small;
+	ShmfsAttribute* large;
+	if (!LookupAttr(fromName, small, large))
 		return B_ENTRY_NOT_FOUND;
+	if (toVnode == this && strcmp(fromName, toName) == 0)
+		return B_OK;
+
+	ShmfsSmallData* oldDstSmall;
+	ShmfsAttribute* oldDstLarge;
+	if (toVnode->LookupAttr(toName, oldDstSmall, oldDstLarge)) {
+		CHECK_RET(toVnode->RemoveAttr(toName));
+		LookupAttr(fromName, small, large);
+	}
 
-	ShmfsAttribute* oldDstAttr = toVnode->fAttrs.Find(toName);
-	if (oldDstAttr != NULL)
-			CHECK_RET(toVnode->RemoveAttr(toName));
+	if (small != NULL) {
+		// the value is copied, adding it may move the small data area
+		uint8 data[ShmfsVnodeAttrs::kMaxSmallDataSize];
+		uint32 type = small->type;
+		size_t size = small->dataSize;
+		memcpy(data, small->Data(), size);
+		{
+			ShmfsIndexUpdate indexUpdate(toVnode, toName);
+			CHECK_RET(toVnode->AddAttr(toName, type, data, size));
+		}
+		ShmfsIndexUpdate indexUpdate(this, fromName);
+		fAttrs->RemoveSmallData(fAttrs->FindSmallData(fromName));
+		return B_OK;
+	}
 
-	RemoveAttr(attr);
+	// everything that can fail comes before the attribute leaves this node
+	ShmfsPooledName* newName;
+	CHECK_RET(Volume()->NamePool()->Acquire(toName, newName));
+	status_t res = toVnode->EnsureAttrs();
+	if (res >= B_OK)
+		res = large->SetOwner(toVnode);
+	if (res < B_OK) {
+		newName->ReleaseReference();
+		return res;
+	}
+	{
+		ShmfsIndexUpdate indexUpdate(this, fromName);
+		RemoveAttr(large);
+	}
 
-	attr->SetName(toName);
-	toVnode->fAttrs.Insert(attr);
+	large->SetName(newName);
+	ShmfsIndexUpdate indexUpdate(toVnode, toName);
+	toVnode->fAttrs->attrs.Insert(large);
 
 	return B_OK;
 }
@@ -441,12 +888,218 @@ status_t ShmfsVnode::RemoveAttr(const char* name)
 {
 	RecursiveLocker lock(Volume()->Lock());
 
-	ShmfsAttribute *attr = fAttrs.Find(name);
-	if (attr == NULL)
+	if (IsFrozen())
+		return B_NOT_ALLOWED;
+
+	ShmfsSmallData* small;
+	ShmfsAttribute* large;
+	if (!LookupAttr(name, small, large))
 		return B_ENTRY_NOT_FOUND;
 
-	RemoveAttr(attr);
-	attr->ReleaseReference();
+	{
+		ShmfsIndexUpdate indexUpdate(this, name);
+		if (small != NULL)
+			fAttrs->RemoveSmallData(small);
+		else
+			RemoveAttr(large);
+	}
+	if (large != NULL) {
+		large->SetOwner(NULL);
+		large->ReleaseReference();
+	}
+
+	return B_OK;
+}
+
+// Packs all attributes into a kernel buffer, so no user memory is touched with
+// the volume lock held. The needed size is counted past a full buffer.
+status_t ShmfsVnode::ReadAttrs(void* buffer, size_t bufferSize)
+{
+	if (bufferSize < sizeof(shmfs_attr_buffer))
+		return B_BAD_VALUE;
+	bufferSize = std::min<size_t>(bufferSize, SHMFS_MAX_BULK_ATTR_BUFFER_SIZE);
+	ArrayDeleter<uint8> data(new(std::nothrow) uint8[bufferSize]);
+	if (!data.IsSet())
+		return B_NO_MEMORY;
+
+	shmfs_attr_buffer* header = (shmfs_attr_buffer*)&data[0];
+	size_t offset = sizeof(shmfs_attr_buffer);
+	uint64 neededSize = offset;
+	uint32 count = 0;
+	status_t readRes = B_OK;
+	auto emit = [&](const char* name, uint32 type, off_t size, ShmfsSmallData* small, ShmfsAttribute* large) {
+		size_t nameSize = strlen(name) + 1;
+		bool omitted = size > SHMFS_MAX_BULK_ATTR_VALUE_SIZE;
+		size_t valueSize = omitted ? 0 : (size_t)size;
+		size_t recordSize = ROUNDUP(offsetof(shmfs_attr_entry, name) + nameSize + valueSize, 8);
+		neededSize += recordSize;
+		if (neededSize > bufferSize)
+			return;
+		shmfs_attr_entry* entry = (shmfs_attr_entry*)&data[offset];
+		memset(entry, 0, recordSize);
+		entry->type = type;
+		entry->flags = omitted ? SHMFS_ATTR_OMITTED : 0;
+		entry->size = size;
+		entry->reclen = (uint32)recordSize;
+		entry->name_size = (uint16)nameSize;
+		memcpy(entry->name, name, nameSize);
+		if (small != NULL)
+			memcpy(entry->name + nameSize, small->Data(), valueSize);
+		else if (valueSize > 0) {
+			status_t res = large->Read(0, entry->name + nameSize, valueSize);
+			if (res < B_OK)
+				readRes = res;
+		}
+		offset += recordSize;
+		count++;
+	};
+	{
+		RecursiveLocker lock(Volume()->Lock(), false, !IsFrozen());
+		if (fAttrs.IsSet()) {
+			for (uint32 pos = 0; pos < fAttrs->smallDataSize; ) {
+				ShmfsSmallData* small = fAttrs->SmallDataAt(pos);
+				emit(small->Name(), small->type, small->dataSize, small, NULL);
+				pos += small->RecordSize();
+			}
+			for (ShmfsAttribute* attr = fAttrs->attrs.LeftMost(); attr != NULL; attr = fAttrs->attrs.Next(attr))
+				emit(attr->Name(), attr->fType, attr->Size(), NULL, attr);
+		}
+	}
+	CHECK_RET(readRes);
+	header->count = count;
+	header->reserved = 0;
+	header->size = neededSize;
+
+	if (neededSize > bufferSize) {
+		CHECK_RET(CopyToIoctlBuffer(buffer, header, sizeof(shmfs_attr_buffer)));
+		return B_BUFFER_OVERFLOW;
+	}
+	return CopyToIoctlBuffer(buffer, &data[0], offset);
+}
+
+// Applies a batch of attribute writes and removals. Everything that can fail
+// is done before the first attribute is changed: values that don't fit the
+// small data area are written to new attributes and the area is reserved.
+status_t ShmfsVnode::WriteAttrs(const void* buffer)
+{
+	shmfs_attr_buffer header;
+	CHECK_RET(CopyFromIoctlBuffer(&header, buffer, sizeof(header)));
+	if (header.size < sizeof(header) || header.size > SHMFS_MAX_BULK_ATTR_BUFFER_SIZE)
+		return B_BAD_VALUE;
+	if (header.count > (header.size - sizeof(header)) / sizeof(shmfs_attr_entry))
+		return B_BAD_VALUE;
+	ArrayDeleter<uint8> data(new(std::nothrow) uint8[header.size]);
+	if (!data.IsSet())
+		return B_NO_MEMORY;
+	CHECK_RET(CopyFromIoctlBuffer(&data[0], buffer, header.size));
+
+	struct Item {
+		shmfs_attr_entry* entry;
+		bool small;
+		BReference<ShmfsAttribute> attr;
+
+		inline const char* Name() {return entry->name;}
+		inline const uint8* Value() {return (const uint8*)entry->name + entry->name_size;}
+		inline bool IsRemove() {return (entry->flags & SHMFS_ATTR_REMOVE) != 0;}
+	};
+	const uint32 count = header.count;
+	ArrayDeleter<Item> items(new(std::nothrow) Item[count]);
+	ArrayDeleter<const char*> names(new(std::nothrow) const char*[count]);
+	if (!items.IsSet() || !names.IsSet())
+		return B_NO_MEMORY;
+
+	size_t offset = sizeof(header);
+	for (uint32 i = 0; i < count; i++) {
+		if (header.size - offset < sizeof(shmfs_attr_entry))
+			return B_BAD_VALUE;
+		shmfs_attr_entry* entry = (shmfs_attr_entry*)&data[offset];
+		size_t valueSize = (entry->flags & SHMFS_ATTR_REMOVE) != 0 ? 0 : entry->size;
+		if (entry->reclen % 8 != 0 || entry->reclen > header.size - offset
+			|| entry->name_size < 2 || entry->name_size > B_ATTR_NAME_LENGTH
+			|| entry->size > entry->reclen
+			|| offsetof(shmfs_attr_entry, name) + entry->name_size + valueSize > entry->reclen
+			|| strnlen(entry->name, entry->name_size) != entry->name_size - 1u)
+			return B_BAD_VALUE;
+		items[i].entry = entry;
+		names[i] = entry->name;
+		offset += entry->reclen;
+	}
+
+	// an attribute may only appear once
+	{
+		ArrayDeleter<const char*> sorted(new(std::nothrow) const char*[count]);
+		if (!sorted.IsSet())
+			return B_NO_MEMORY;
+		std::copy(&names[0], &names[0] + count, &sorted[0]);
+		std::sort(&sorted[0], &sorted[0] + count, [](const char* a, const char* b) {
+			return strcmp(a, b) < 0;
+		});
+		for (uint32 i = 1; i < count; i++) {
+			if (strcmp(sorted[i - 1], sorted[i]) == 0)
+				return B_BAD_VALUE;
+		}
+	}
+
+	RecursiveLocker lock(Volume()->Lock());
+	if (IsFrozen())
+		return B_NOT_ALLOWED;
+	CHECK_RET(EnsureAttrs());
+	ShmfsIndexUpdate indexUpdate(this, &names[0], count);
+	CHECK_RET(indexUpdate.InitCheck());
+
+	ShmfsSmallData* small;
+	ShmfsAttribute* large;
+	uint32 smallDataSize = fAttrs->smallDataSize;
+	for (uint32 i = 0; i < count; i++) {
+		if (LookupAttr(items[i].Name(), small, large) && small != NULL)
+			smallDataSize -= small->RecordSize();
+	}
+	for (uint32 i = 0; i < count; i++) {
+		Item &item = items[i];
+		if (item.IsRemove())
+			continue;
+		shmfs_attr_entry* entry = item.entry;
+		if (entry->size <= ShmfsVnodeAttrs::kMaxSmallDataSize) {
+			uint32 recordSize = ShmfsSmallData::RecordSize(entry->name_size, entry->size);
+			if (smallDataSize + recordSize <= ShmfsVnodeAttrs::kMaxSmallDataAreaSize) {
+				item.small = true;
+				smallDataSize += recordSize;
+				continue;
+			}
+		}
+		item.small = false;
+		item.attr.SetTo(new(std::nothrow) ShmfsAttribute(), true);
+		if (!item.attr.IsSet())
+			return B_NO_MEMORY;
+		CHECK_RET(item.attr->SetName(Volume()->NamePool(), item.Name()));
+		CHECK_RET(item.attr->SetOwner(this));
+		item.attr->fType = entry->type;
+		size_t length = entry->size;
+		CHECK_RET(item.attr->Write(0, item.Value(), length));
+	}
+	CHECK_RET(fAttrs->EnsureSmallDataSize(smallDataSize));
+
+	// nothing fails from here on
+	for (uint32 i = 0; i < count; i++) {
+		if (!LookupAttr(items[i].Name(), small, large))
+			continue;
+		if (small != NULL)
+			fAttrs->RemoveSmallData(small);
+		else {
+			RemoveAttr(large);
+			large->SetOwner(NULL);
+			large->ReleaseReference();
+		}
+	}
+	for (uint32 i = 0; i < count; i++) {
+		Item &item = items[i];
+		if (item.IsRemove())
+			continue;
+		if (item.small)
+			fAttrs->AddSmallData(item.Name(), item.entry->type, item.Value(), (uint32)item.entry->size, small);
+		else
+			fAttrs->attrs.Insert(item.attr.Detach());
+	}
 
 	return B_OK;
 }
@@ -0,0 +1,104 @@
+#include "Shmfs.h"
+
+#include <KernelExport.h>
+#include <smp.h>
+
+#include <new>
+#include <algorithm>
+
+
+ShmfsVnodeReaper::~ShmfsVnodeReaper()
+{
+	Flush();
+	fQuit = true;
+	if (fWorkerCount > 0)
+		release_sem_etc(fStartSem, fWorkerCount, 0);
+	for (int32 i = 0; i < fWorkerCount; i++) {
+		status_t res;
+		wait_for_thread(fWorkers[i], &res);
+	}
+	if (fStartSem >= B_OK)
+		delete_sem(fStartSem);
+	if (fDoneSem >= B_OK)
+		delete_sem(fDoneSem);
+	delete[] fBatch;
+}
+
+status_t ShmfsVnodeReaper::Init()
+{
+	fBatch = new(std::nothrow) ShmfsVnode*[kBatchSize];
+	if (fBatch == NULL)
+		return B_NO_MEMORY;
+	return B_OK;
+}
+
+void ShmfsVnodeReaper::SpawnWorkers()
+{
+	// Workers are optional, without them Flush() releases on the calling
+	// thread.
+	fWorkersSpawned = true;
+	fStartSem = create_sem(0, "shmfs reaper start");
+	fDoneSem = create_sem(0, "shmfs reaper done");
+	if (fStartSem < B_OK || fDoneSem < B_OK)
+		return;
+
+	int32 workerCount = std::min<int32>(smp_get_num_cpus() - 1, kMaxWorkers);
+	for (int32 i = 0; i < workerCount; i++) {
+		thread_id thread = spawn_kernel_thread(WorkerEntry, "shmfs reaper", B_NORMAL_PRIORITY, this);
+		if (thread < B_OK)
+			break;
+		fWorkers[fWorkerCount++] = thread;
+		resume_thread(thread);
+	}
+}
+
+status_t ShmfsVnodeReaper::WorkerEntry(void* arg)
+{
+	ShmfsVnodeReaper* reaper = (ShmfsVnodeReaper*)arg;
+	for (;;) {
+		if (acquire_sem(reaper->fStartSem) < B_OK || reaper->fQuit)
+			return B_OK;
+		reaper->ReleaseBatchItems();
+		release_sem(reaper->fDoneSem);
+	}
+}
+
+void ShmfsVnodeReaper::ReleaseBatchItems()
+{
+	for (;;) {
+		int32 index = atomic_add(&fNext, 1);
+		if (index >= fCount)
+			return;
+		fBatch[index]->ReleaseReference();
+	}
+}
+
+void ShmfsVnodeReaper::Add(ShmfsVnode* vnode)
+{
+	if (fBatch == NULL) {
+		vnode->ReleaseReference();
+		return;
+	}
+	fBatch[fCount++] = vnode;
+}
+
+void ShmfsVnodeReaper::Flush()
+{
+	if (fCount == 0)
+		return;
+
+	// small batches are not worth waking up other CPUs
+	const int32 kMinPerWorker = 64;
+	if (!fWorkersSpawned && fCount >= 2 * kMinPerWorker)
+		SpawnWorkers();
+
+	fNext = 0;
+	int32 workerCount = std::min<int32>(fWorkerCount, fCount / kMinPerWorker - 1);
+	if (workerCount > 0)
+		release_sem_etc(fStartSem, workerCount, 0);
+	ReleaseBatchItems();
+	if (workerCount > 0)
+		acquire_sem_etc(fDoneSem, workerCount, 0, 0);
+
+	fCount = 0;
+}
@@ -1,10 +1,18 @@
 #include "Shmfs.h"
 
 #include <fs_info.h>
+#include <TypeConstants.h>
+#include <dirent.h>
+#include <sys/stat.h>
 
 #include <util/AutoLock.h>
+#include <vm/vm_page.h>
 
 #include <new>
+#include <algorithm>
+#include <stdlib.h>
+#include <ctype.h>
+#include <unistd.h>
 
 
 //#pragma mark - ShmfsVolume
@@ -14,6 +22,21 @@ ShmfsVolume::ShmfsVolume()
 	fIdPool.Register(1, 0x7fffffff);
 }
 
+ShmfsVolume::~ShmfsVolume()
+{
+	while (ShmfsIndex* index = fIndexes.RemoveHead())
+		delete index;
+
+	ShmfsQuota* quota = fQuotas.Clear(true);
+	while (quota != NULL) {
+		ShmfsQuota* next = quota->hashLink;
+		delete quota;
+		quota = next;
+	}
+
+	rw_lock_destroy(&fAttrWriterLock);
+}
+
 void ShmfsVolume::ListVnodes()
 {
 	dprintf("ListVnodes()\n");
@@ -24,15 +47,28 @@ void ShmfsVolume::ListVnodes()
 
 status_t ShmfsVolume::RegisterVnode(ShmfsVnode *vnode)
 {
-	RecursiveLocker lock(Lock());
-
+	// the id pool has its own lock
 	uint64_t id;
-	if (!fIdPool.Alloc(id, 1))
+	if (!fIdPool.Alloc(id))
 		return B_NO_MEMORY;
 
+	RecursiveLocker lock(Lock());
+
+	vnode->fUid = geteuid();
+	vnode->fGid = getegid();
+	status_t res = LookupQuotas(vnode->fUid, vnode->fGid, vnode->fUserQuota, vnode->fGroupQuota);
+	if (res == B_OK)
+		res = CheckSpace(vnode, 0, 1);
+	if (res < B_OK) {
+		fIdPool.Free(id);
+		return res;
+	}
+
 	vnode->fVolume = this;
 	vnode->fId = id;
 	fIds.Insert(vnode);
+	vnode->fIdMapped = true;
+	AddUsage(vnode, 0, 1);
 
 	TRACE("+ShmfsVnode(%" B_PRId64 ", \"%s\"), adr: %p\n", vnode->fId, vnode->Name(), vnode);
 	TRACE("  &fIdNode: %p\n", &vnode->fIdNode);
@@ -40,6 +76,227 @@ status_t ShmfsVolume::RegisterVnode(ShmfsVnode *vnode)
 	return B_OK;
 }
 
+// Removes a dying node from the id map ahead of its destruction, so batches
+// of nodes can be removed under one lock acquisition. Called with the volume
+// lock held.
+void ShmfsVolume::UnmapVnode(ShmfsVnode *vnode)
+{
+	// on unmount the map is cleared as a whole
+	if (!vnode->fIdMapped || fUnmounting)
+		return;
+	fIds.Remove(vnode);
+	vnode->fIdMapped = false;
+}
+
+// Hands a new node to the VFS in one step, the VFS reference is acquired like
+// in GetVnode(). Saves the get_vnode() round trip for nodes that have to be
+// in use right away.
+status_t ShmfsVolume::PublishVnode(ShmfsVnode *vnode)
+{
+	vnode->AcquireReference();
+	status_t res = publish_vnode(fBase, vnode->Id(), vnode, &gShmfsVnodeOps, vnode->TypeMode(), 0);
+	if (res < B_OK) {
+		vnode->ReleaseReference();
+		return res;
+	}
+	return B_OK;
+}
+
+
+//#pragma mark - Capacity and quotas
+
+ShmfsQuota* ShmfsVolume::LookupQuota(uint32 type, uint32 id, bool create)
+{
+	uint64 key = ShmfsQuota::MakeKey(type, id);
+	ShmfsQuota* quota = fQuotas.Lookup(key);
+	if (quota != NULL || !create)
+		return quota;
+
+	ObjectDeleter<ShmfsQuota> newQuota(new(std::nothrow) ShmfsQuota);
+	if (!newQuota.IsSet())
+		return NULL;
+	newQuota->key = key;
+	if (newQuota->usedPages.Init() < B_OK || newQuota->usedNodes.Init() < B_OK)
+		return NULL;
+	if (fQuotas.Insert(newQuota.Get()) < B_OK)
+		return NULL;
+	return newQuota.Detach();
+}
+
+// Gets the quota entries of an owner, creating them. Called with the volume
+// lock held, the entries live until unmount.
+status_t ShmfsVolume::LookupQuotas(uid_t uid, gid_t gid, ShmfsQuota* &userQuota, ShmfsQuota* &groupQuota)
+{
+	userQuota = LookupQuota(SHMFS_QUOTA_USER, uid, true);
+	groupQuota = LookupQuota(SHMFS_QUOTA_GROUP, gid, true);
+	if (userQuota == NULL || groupQuota == NULL)
+		return B_NO_MEMORY;
+	return B_OK;
+}
+
+// Checks whether pages and nodes can be added for the owner of vnode without
+// exceeding the volume capacity or the owner's quotas. Only the per-CPU
+// counters are read, no lock is needed.
+status_t ShmfsVolume::CheckSpace(ShmfsVnode *vnode, int64 pages, int64 nodes)
+{
+	if (!fUsedPages.Fits(pages, fMaxPages) || !fUsedNodes.Fits(nodes, fMaxNodes))
+		return B_DEVICE_FULL;
+	ShmfsQuota* quotas[] = {vnode->fUserQuota, vnode->fGroupQuota};
+	for (ShmfsQuota* quota: quotas) {
+		if (quota == NULL)
+			continue;
+		if (!quota->usedPages.Fits(pages, atomic_get64(&quota->maxPages))
+			|| !quota->usedNodes.Fits(nodes, atomic_get64(&quota->maxNodes))) {
+			return B_DEVICE_FULL;
+		}
+	}
+	return B_OK;
+}
+
+void ShmfsVolume::AddUsage(ShmfsVnode *vnode, int64 pages, int64 nodes)
+{
+	if (pages == 0 && nodes == 0)
+		return;
+	fUsedPages.Add(pages);
+	fUsedNodes.Add(nodes);
+
+	ShmfsQuota* quotas[] = {vnode->fUserQuota, vnode->fGroupQuota};
+	for (ShmfsQuota* quota: quotas) {
+		if (quota == NULL)
+			continue;
+		quota->usedPages.Add(pages);
+		quota->usedNodes.Add(nodes);
+	}
+}
+
+status_t ShmfsVolume::GetQuota(shmfs_quota &quota)
+{
+	RecursiveLocker lock(Lock());
+	ShmfsQuota* entry = LookupQuota(quota.type, quota.id, false);
+	if (entry == NULL) {
+		quota.max_pages = -1;
+		quota.max_nodes = -1;
+		quota.used_pages = 0;
+		quota.used_nodes = 0;
+		return B_OK;
+	}
+	quota.max_pages = entry->maxPages;
+	quota.max_nodes = entry->maxNodes;
+	quota.used_pages = entry->usedPages.Sum();
+	quota.used_nodes = entry->usedNodes.Sum();
+	return B_OK;
+}
+
+status_t ShmfsVolume::SetQuota(shmfs_quota &quota)
+{
+	if (geteuid() != 0)
+		return B_NOT_ALLOWED;
+	if (quota.type != SHMFS_QUOTA_USER && quota.type != SHMFS_QUOTA_GROUP)
+		return B_BAD_VALUE;
+
+	RecursiveLocker lock(Lock());
+	ShmfsQuota* entry = LookupQuota(quota.type, quota.id, true);
+	if (entry == NULL)
+		return B_NO_MEMORY;
+	// read by CheckSpace() without the lock
+	atomic_set64(&entry->maxPages, quota.max_pages < 0 ? -1 : quota.max_pages);
+	atomic_set64(&entry->maxNodes, quota.max_nodes < 0 ? -1 : quota.max_nodes);
+	return GetQuota(quota);
+}
+
+
+//#pragma mark - Mounting
+
+// Parses a number with an optional k, m, g or t suffix, or a percentage of
+// physical memory in bytes if percentOf is not 0.
+static status_t ParseNumber(const char* str, uint64 percentOf, int64 &value)
+{
+	char* end;
+	uint64 number = strtoull(str, &end, 10);
+	if (end == str)
+		return B_BAD_VALUE;
+	int shift = 0;
+	switch (tolower(*end)) {
+		case '\0':
+			break;
+		case 'k': shift = 10; break;
+		case 'm': shift = 20; break;
+		case 'g': shift = 30; break;
+		case 't': shift = 40; break;
+		case '%':
+			if (percentOf == 0 || number > 100)
+				return B_BAD_VALUE;
+			value = percentOf / 100 * number;
+			return end[1] == '\0' ? B_OK : B_BAD_VALUE;
+		default:
+			return B_BAD_VALUE;
+	}
+	if (*end != '\0' && end[1] != '\0')
+		return B_BAD_VALUE;
+	if (number > ((uint64)INT64_MAX >> shift))
+		return B_BAD_VALUE;
+	value = number << shift;
+	return B_OK;
+}
+
+// Mount options are given as a comma separated list:
+//   size=<bytes>[k|m|g|t|%]   maximum size of file data, 0 for no limit
+//   nr_inodes=<count>[k|m|g]  maximum number of nodes, 0 for no limit
+//   strictatime               update the access time on every read
+//   relatime                  update the access time once a day or when it
+//                             is older than the last change (default)
+//   noatime                   never update the access time on read
+status_t ShmfsVolume::ParseOptions(const char* args)
+{
+	if (args == NULL)
+		return B_OK;
+	char options[B_PATH_NAME_LENGTH];
+	if (strlcpy(options, args, sizeof(options)) >= sizeof(options))
+		return B_NAME_TOO_LONG;
+
+	char* next = options;
+	while (next != NULL) {
+		char* option = next;
+		next = strchr(option, ',');
+		if (next != NULL)
+			*next++ = '\0';
+		if (*option == '\0')
+			continue;
+
+		if (strcmp(option, "strictatime") == 0) {
+			fAtimeMode = kAtimeStrict;
+			continue;
+		}
+		if (strcmp(option, "relatime") == 0) {
+			fAtimeMode = kAtimeRelative;
+			continue;
+		}
+		if (strcmp(option, "noatime") == 0) {
+			fAtimeMode = kAtimeNone;
+			continue;
+		}
+
+		char* value = strchr(option, '=');
+		if (value == NULL) {
+			dprintf("shmfs: unknown mount option \"%s\"\n", option);
+			return B_BAD_VALUE;
+		}
+		*value++ = '\0';
+
+		int64 number;
+		if (strcmp(option, "size") == 0) {
+			CHECK_RET(ParseNumber(value, (uint64)vm_page_num_pages() * B_PAGE_SIZE, number));
+			fMaxPages = number == 0 ? -1 : (number + B_PAGE_SIZE - 1) / B_PAGE_SIZE;
+		} else if (strcmp(option, "nr_inodes") == 0) {
+			CHECK_RET(ParseNumber(value, 0, number));
+			fMaxNodes = number == 0 ? -1 : number;
+		} else {
+			dprintf("shmfs: unknown mount option \"%s\"\n", option);
+			return B_BAD_VALUE;
+		}
+	}
+	return B_OK;
+}
 
 status_t ShmfsVolume::Mount(ShmfsVolume* &volume, fs_volume *base, const char* device, uint32 flags, const char* args, ino_t &rootVnodeID)
 {
@@ -49,11 +306,21 @@ status_t ShmfsVolume::Mount(ShmfsVolume* &volume, fs_volume *base, const char* d
 	RecursiveLocker lock(vol->Lock());
 	vol->fBase = base;
 	volume = vol.Get();
+	CHECK_RET(vol->ParseOptions(args));
+	CHECK_RET(vol->fUsedPages.Init());
+	CHECK_RET(vol->fUsedNodes.Init());
+	CHECK_RET(vol->fQuotas.Init());
+	CHECK_RET(vol->fNamePool.Init());
+	CHECK_RET(vol->fIdPool.Init());
+	CHECK_RET(vol->fNotifier.Init(vol.Get()));
+	CHECK_RET(vol->AddIndex("name", B_STRING_TYPE, ShmfsIndex::kName, vol->fNameIndex));
+	CHECK_RET(vol->AddIndex("size", B_INT64_TYPE, ShmfsIndex::kSize, vol->fSizeIndex));
+	CHECK_RET(vol->AddIndex("last_modified", B_INT64_TYPE, ShmfsIndex::kLastModified, vol->fLastModifiedIndex));
 
 	vol->fRootVnode.SetTo(new(std::nothrow) ShmfsDirectoryVnode(), true);
 	CHECK_RET(vol->RegisterVnode(vol->fRootVnode));
 	rootVnodeID = vol->fRootVnode->Id();
-	CHECK_RET(get_vnode(vol->Base(), rootVnodeID, NULL));
+	CHECK_RET(vol->PublishVnode(vol->fRootVnode));
 
 	vol.Detach();
 	return B_OK;
@@ -61,26 +328,51 @@ status_t ShmfsVolume::Mount(ShmfsVolume* &volume, fs_volume *base, const char* d
 
 status_t ShmfsVolume::Unmount()
 {
+	bigtime_t startTime = system_time();
+	int32 nodeCount = fIds.Count();
+
+	// pending notifications hold node references
+	fNotifier.Shutdown();
+
+	// The VFS has put all vnodes at this point, the tree only holds
+	// references to itself. Tear it down iteratively and in parallel, ids
+	// and pooled names are not returned one by one but freed with the
+	// volume. Nodes go back to the object caches one by one, those are
+	// shared by all volumes.
+	ShmfsVnodeReaper reaper;
+	reaper.Init();
 	{
 		RecursiveLocker lock(Lock());
-		fRootVnode.Unset();
+		fUnmounting = true;
+		fIds.Clear();
+		fNamePool.Discard();
 	}
+	ShmfsDirectoryVnode::ReapTree(static_cast<ShmfsDirectoryVnode*>(fRootVnode.Detach()), reaper, false);
+
+	TRACE("ShmfsVolume::Unmount(): %" B_PRId32 " nodes in %" B_PRId64 " us\n", nodeCount, system_time() - startTime);
 	delete this;
 	return B_OK;
 }
 
 status_t ShmfsVolume::ReadFsInfo(struct fs_info &info)
 {
-	RecursiveLocker lock(Lock());
+	// without a limit the volume can grow up to physical memory and the id
+	// range
+	int64 totalPages = fMaxPages >= 0 ? fMaxPages : (int64)vm_page_num_pages();
+	int64 totalNodes = fMaxNodes >= 0 ? fMaxNodes : 0x7fffffff;
+	int64 usedPages = fUsedPages.Sum();
+	int64 usedNodes = fUsedNodes.Sum();
+
 	info = {
 		.dev = Id(),
 		.root = fRootVnode->Id(),
-		.block_size = 512,
+		.flags = B_FS_HAS_ATTR | B_FS_HAS_MIME | B_FS_HAS_QUERY,
+		.block_size = B_PAGE_SIZE,
 		.io_size = B_PAGE_SIZE,
-		.total_blocks = INT64_MAX / 512,
-		.free_blocks = INT64_MAX / 512,
-		.total_nodes = INT64_MAX,
-		.free_nodes = INT64_MAX,
+		.total_blocks = totalPages,
+		.free_blocks = std::max<int64>(totalPages - usedPages, 0),
+		.total_nodes = totalNodes,
+		.free_nodes = std::max<int64>(totalNodes - usedNodes, 0),
 	};
 	strcpy(info.volume_name, "shmfs");
 	return B_OK;
@@ -96,11 +388,232 @@ status_t ShmfsVolume::GetVnode(ino_t id, ShmfsVnode* &vnode, int &type, uint32 &
 	if (vnode == NULL)
 		return ENOENT;
 
-	struct stat stat;
-	CHECK_RET(vnode->ReadStat(stat));
-	type = stat.st_mode;
+	type = vnode->TypeMode();
 	flags = 0;
 
 	vnode->AcquireReference();
 	return B_OK;
 }
+
+
+//#pragma mark - Indexes
+
+status_t ShmfsVolume::AddIndex(const char* name, uint32 type, ShmfsIndex::Kind kind, ShmfsIndex* &index)
+{
+	index = new(std::nothrow) ShmfsIndex(name, type, kind);
+	if (index == NULL)
+		return B_NO_MEMORY;
+	fIndexes.Insert(index);
+	return B_OK;
+}
+
+ShmfsIndex* ShmfsVolume::FindIndex(const char* name)
+{
+	for (ShmfsIndex* index = fIndexes.First(); index != NULL; index = fIndexes.GetNext(index)) {
+		if (strcmp(index->Name(), name) == 0)
+			return index;
+	}
+	return NULL;
+}
+
+// Called with the volume lock held, returns once attribute writers that don't
+// hold the volume lock are done. No new ones start until it is released.
+void ShmfsVolume::WaitForAttrWriters()
+{
+	WriteLocker writerLocker(fAttrWriterLock);
+}
+
+// Called with the volume lock held after a node was linked into a directory.
+// A node whose entry can't be allocated is missing from indexed query
+// results, that is logged.
+void ShmfsVolume::IndexLinked(ShmfsVnode *vnode)
+{
+	uint8 key[ShmfsIndex::kMaxKeyLength];
+	size_t length;
+	for (ShmfsIndex* index = fIndexes.First(); index != NULL; index = fIndexes.GetNext(index)) {
+		if (!index->GetKey(vnode, key, length))
+			continue;
+		status_t res = index->Insert(vnode, key, length);
+		if (res < B_OK) {
+			dprintf("shmfs: node %" B_PRId64 " is missing from index \"%s\": %s\n",
+				vnode->Id(), index->Name(), strerror(res));
+		}
+	}
+	for (ShmfsQuery* query = fLiveQueries.First(); query != NULL; query = fLiveQueries.GetNext(query)) {
+		if (query->Matches(vnode))
+			query->NotifyEntry(vnode, true);
+	}
+}
+
+// Called with the volume lock held before a node is unlinked.
+void ShmfsVolume::IndexUnlinked(ShmfsVnode *vnode)
+{
+	uint8 key[ShmfsIndex::kMaxKeyLength];
+	size_t length;
+	for (ShmfsIndex* index = fIndexes.First(); index != NULL; index = fIndexes.GetNext(index)) {
+		if (index->GetKey(vnode, key, length))
+			index->Remove(vnode, key, length);
+	}
+	for (ShmfsQuery* query = fLiveQueries.First(); query != NULL; query = fLiveQueries.GetNext(query)) {
+		if (query->Matches(vnode))
+			query->NotifyEntry(vnode, false);
+	}
+}
+
+status_t ShmfsVolume::OpenIndexDir(ShmfsIndexDirIterator* &cookie)
+{
+	cookie = new(std::nothrow) ShmfsIndexDirIterator{0};
+	if (cookie == NULL)
+		return B_NO_MEMORY;
+	return B_OK;
+}
+
+status_t ShmfsVolume::CloseIndexDir(ShmfsIndexDirIterator* cookie)
+{
+	return B_OK;
+}
+
+status_t ShmfsVolume::FreeIndexDirCookie(ShmfsIndexDirIterator* cookie)
+{
+	delete cookie;
+	return B_OK;
+}
+
+status_t ShmfsVolume::ReadIndexDir(ShmfsIndexDirIterator* cookie, struct dirent* buffer, size_t bufferSize, uint32 &num)
+{
+	RecursiveLocker lock(Lock());
+
+	uint32 maxNum = num;
+	num = 0;
+	ShmfsIndex* index = fIndexes.First();
+	for (int32 i = 0; index != NULL && i < cookie->pos; i++)
+		index = fIndexes.GetNext(index);
+	for (; index != NULL && num < maxNum; index = fIndexes.GetNext(index)) {
+		size_t nameLen = strlen(index->Name()) + 1;
+		size_t direntSize = offsetof(struct dirent, d_name) + nameLen;
+		if (bufferSize < direntSize) {
+			if (num == 0)
+				return B_BUFFER_OVERFLOW;
+			break;
+		}
+		*buffer = {
+			.d_dev = Id(),
+			.d_reclen = (uint16)direntSize
+		};
+		memcpy(buffer->d_name, index->Name(), nameLen);
+		bufferSize -= direntSize;
+		*(uint8**)&buffer += direntSize;
+		cookie->pos++;
+		num++;
+	}
+	return B_OK;
+}
+
+status_t ShmfsVolume::RewindIndexDir(ShmfsIndexDirIterator* cookie)
+{
+	cookie->pos = 0;
+	return B_OK;
+}
+
+status_t ShmfsVolume::CreateIndex(const char* name, uint32 type, uint32 flags)
+{
+	RecursiveLocker lock(Lock());
+
+	if (strlen(name) >= B_ATTR_NAME_LENGTH)
+		return B_NAME_TOO_LONG;
+	if (FindIndex(name) != NULL)
+		return B_FILE_EXISTS;
+	if (!ShmfsIndex::IsSupportedType(type))
+		return B_BAD_VALUE;
+
+	ShmfsIndex* index;
+	CHECK_RET(AddIndex(name, type, ShmfsIndex::kAttribute, index));
+	fAttrIndexCount++;
+	WaitForAttrWriters();
+	uint8 key[ShmfsIndex::kMaxKeyLength];
+	size_t length;
+	for (ShmfsVnode *vnode = fIds.LeftMost(); vnode != NULL; vnode = fIds.Next(vnode)) {
+		if (vnode->fParent == NULL || !index->GetKey(vnode, key, length))
+			continue;
+		status_t res = index->Insert(vnode, key, length);
+		if (res < B_OK) {
+			fIndexes.Remove(index);
+			fAttrIndexCount--;
+			delete index;
+			return res;
+		}
+	}
+	return B_OK;
+}
+
+status_t ShmfsVolume::RemoveIndex(const char* name)
+{
+	RecursiveLocker lock(Lock());
+
+	ShmfsIndex* index = FindIndex(name);
+	if (index == NULL)
+		return B_ENTRY_NOT_FOUND;
+	if (index->GetKind() != ShmfsIndex::kAttribute)
+		return B_NOT_ALLOWED;
+	fIndexes.Remove(index);
+	fAttrIndexCount--;
+	delete index;
+	return B_OK;
+}
+
+status_t ShmfsVolume::ReadIndexStat(const char* name, struct stat &stat)
+{
+	RecursiveLocker lock(Lock());
+
+	ShmfsIndex* index = FindIndex(name);
+	if (index == NULL)
+		return B_ENTRY_NOT_FOUND;
+	stat = {
+		.st_dev = Id(),
+		.st_mode = S_INDEX_DIR | 0755,
+		.st_size = index->Count(),
+		.st_type = index->Type(),
+	};
+	return B_OK;
+}
+
+
+//#pragma mark - Queries
+
+status_t ShmfsVolume::OpenQuery(const char* query, uint32 flags, port_id port, uint32 token, ShmfsQuery* &cookie)
+{
+	RecursiveLocker lock(Lock());
+	CHECK_RET(ShmfsQuery::Create(this, query, flags, port, token, cookie));
+	if (cookie->IsLive()) {
+		fLiveQueries.Insert(cookie);
+		WaitForAttrWriters();
+	}
+	return B_OK;
+}
+
+status_t ShmfsVolume::CloseQuery(ShmfsQuery* cookie)
+{
+	RecursiveLocker lock(Lock());
+	if (cookie->IsLive())
+		fLiveQueries.Remove(cookie);
+	return B_OK;
+}
+
+status_t ShmfsVolume::FreeQueryCookie(ShmfsQuery* cookie)
+{
+	delete cookie;
+	return B_OK;
+}
+
+status_t ShmfsVolume::ReadQuery(ShmfsQuery* cookie, struct dirent* buffer, size_t bufferSize, uint32 &num)
+{
+	RecursiveLocker lock(Lock());
+	return cookie->Read(buffer, bufferSize, num);
+}
+
+status_t ShmfsVolume::RewindQuery(ShmfsQuery* cookie)
+{
+	RecursiveLocker lock(Lock());
+	cookie->Rewind();
+	return B_OK;
+}
@@ -1,13 +1,48 @@
 #include "Shmfs.h"
 
 
+status_t ShmfsInitObjectCaches()
+{
+	status_t res = B_OK;
+	if (res >= B_OK) res = ShmfsFileVnode::InitCache("shmfs file vnodes");
+	if (res >= B_OK) res = ShmfsDirectoryVnode::InitCache("shmfs directory vnodes");
+	if (res >= B_OK) res = ShmfsSymlinkVnode::InitCache("shmfs symlink vnodes");
+	if (res >= B_OK) res = ShmfsAttribute::InitCache("shmfs attributes");
+	if (res >= B_OK) res = ShmfsAttrCookie::InitCache("shmfs attr cookies");
+	if (res >= B_OK) res = ShmfsFileCookie::InitCache("shmfs file cookies");
+	if (res >= B_OK) res = ShmfsDirIterator::InitCache("shmfs dir iterators");
+	if (res >= B_OK) res = ShmfsAttrDirIterator::InitCache("shmfs attr dir iterators");
+	if (res < B_OK)
+		ShmfsUninitObjectCaches();
+	return res;
+}
+
+void ShmfsUninitObjectCaches()
+{
+	ShmfsAttrDirIterator::UninitCache();
+	ShmfsDirIterator::UninitCache();
+	ShmfsFileCookie::UninitCache();
+	ShmfsAttrCookie::UninitCache();
+	ShmfsAttribute::UninitCache();
+	ShmfsSymlinkVnode::UninitCache();
+	ShmfsDirectoryVnode::UninitCache();
+	ShmfsFileVnode::UninitCache();
+}
+
+
 static status_t shmfs_std_ops(int32 op, ...)
 {
 	switch (op) {
 		case B_MODULE_INIT: {
-			return B_OK;
+			CHECK_RET(ShmfsInitObjectCaches());
+			status_t res = ShmfsInitClock();
+			if (res < B_OK)
+				ShmfsUninitObjectCaches();
+			return res;
 		}
 		case B_MODULE_UNINIT: {
+			ShmfsUninitClock();
+			ShmfsUninitObjectCaches();
 			return B_OK;
 		}
 	}
@@ -15,7 +50,7 @@ static status_t shmfs_std_ops(int32 op, ...)
 }
 
 
-static fs_vnode_ops sVnodeOps = {
+fs_vnode_ops gShmfsVnodeOps = {
 	.lookup = [](fs_volume* volume, fs_vnode* dir, const char* name, ino_t* id) {
 		return static_cast<ShmfsVnode*>(dir->private_node)->Lookup(name, *id);
 	},
@@ -29,7 +64,7 @@ static fs_vnode_ops sVnodeOps = {
 		return static_cast<ShmfsVnode*>(vnode->private_node)->RemoveVnode(reenter);
 	},
 	.ioctl = [](fs_volume* volume, fs_vnode* vnode, void* cookie, uint32 op, void* buffer, size_t length) {
-		return static_cast<ShmfsVnode*>(vnode->private_node)->Ioctl((ShmfsFileCookie*)cookie, op, buffer, length);
+		return static_cast<ShmfsVnode*>(vnode->private_node)->Ioctl(cookie, op, buffer, length);
 	},
 	.set_flags = [](fs_volume* volume, fs_vnode* vnode, void* cookie, int flags) {
 		return static_cast<ShmfsVnode*>(vnode->private_node)->SetFlags((ShmfsFileCookie*)cookie, flags);
@@ -114,28 +149,28 @@ static fs_vnode_ops sVnodeOps = {
 		return static_cast<ShmfsVnode*>(vnode->private_node)->RewindAttrDir((ShmfsAttrDirIterator*)cookie);
 	},
 	.create_attr = [](fs_volume* volume, fs_vnode* vnode, const char* name, uint32 type, int openMode, void** cookie) {
-		return static_cast<ShmfsVnode*>(vnode->private_node)->CreateAttr(name, type, openMode, *(ShmfsAttribute**)cookie);
+		return static_cast<ShmfsVnode*>(vnode->private_node)->CreateAttr(name, type, openMode, *(ShmfsAttrCookie**)cookie);
 	},
 	.open_attr = [](fs_volume* volume, fs_vnode* vnode, const char* name, int openMode, void** cookie) {
-		return static_cast<ShmfsVnode*>(vnode->private_node)->OpenAttr(name, openMode, *(ShmfsAttribute**)cookie);
+		return static_cast<ShmfsVnode*>(vnode->private_node)->OpenAttr(name, openMode, *(ShmfsAttrCookie**)cookie);
 	},
 	.close_attr = [](fs_volume* volume, fs_vnode* vnode, void* cookie) {
-		return static_cast<ShmfsVnode*>(vnode->private_node)->CloseAttr((ShmfsAttribute*)cookie);
+		return static_cast<ShmfsVnode*>(vnode->private_node)->CloseAttr((ShmfsAttrCookie*)cookie);
 	},
 	.free_attr_cookie = [](fs_volume* volume, fs_vnode* vnode, void* cookie) {
-		return static_cast<ShmfsVnode*>(vnode->private_node)->FreeAttrCookie((ShmfsAttribute*)cookie);
+		return static_cast<ShmfsVnode*>(vnode->private_node)->FreeAttrCookie((ShmfsAttrCookie*)cookie);
 	},
 	.read_attr = [](fs_volume* volume, fs_vnode* vnode, void* cookie, off_t pos, void* buffer, size_t* length) {
-		return static_cast<ShmfsVnode*>(vnode->private_node)->ReadAttr((ShmfsAttribute*)cookie, pos, buffer, *length);
+		return static_cast<ShmfsVnode*>(vnode->private_node)->ReadAttr((ShmfsAttrCookie*)cookie, pos, buffer, *length);
 	},
 	.write_attr = [](fs_volume* volume, fs_vnode* vnode, void* cookie, off_t pos, const void* buffer, size_t* length) {
-		return static_cast<ShmfsVnode*>(vnode->private_node)->WriteAttr((ShmfsAttribute*)cookie, pos, buffer, *length);
+		return static_cast<ShmfsVnode*>(vnode->private_node)->WriteAttr((ShmfsAttrCookie*)cookie, pos, buffer, *length);
 	},
 	.read_attr_stat = [](fs_volume* volume, fs_vnode* vnode, void* cookie, struct stat* stat) {
-		return static_cast<ShmfsVnode*>(vnode->private_node)->ReadAttrStat((ShmfsAttribute*)cookie, *stat);
+		return static_cast<ShmfsVnode*>(vnode->private_node)->ReadAttrStat((ShmfsAttrCookie*)cookie, *stat);
 	},
 	.write_attr_stat = [](fs_volume* volume, fs_vnode* vnode, void* cookie, const struct stat* stat, int statMask) {
-		return static_cast<ShmfsVnode*>(vnode->private_node)->WriteAttrStat((ShmfsAttribute*)cookie, *stat, statMask);
+		return static_cast<ShmfsVnode*>(vnode->private_node)->WriteAttrStat((ShmfsAttrCookie*)cookie, *stat, statMask);
 	},
 	.rename_attr = [](fs_volume* volume, fs_vnode* fromVnode, const char* fromName, fs_vnode* toVnode, const char* toName) {
 		return static_cast<ShmfsVnode*>(fromVnode->private_node)->RenameAttr(fromName, static_cast<ShmfsVnode*>(toVnode->private_node), toName);
@@ -153,9 +188,50 @@ static fs_volume_ops sVolumeOps = {
 		return static_cast<ShmfsVolume*>(volume->private_volume)->ReadFsInfo(*info);
 	},
 	.get_vnode = [](fs_volume* volume, ino_t id, fs_vnode* vnode, int* type, uint32* flags, bool reenter) {
-		vnode->ops = &sVnodeOps;
+		vnode->ops = &gShmfsVnodeOps;
 		return static_cast<ShmfsVolume*>(volume->private_volume)->GetVnode(id, *(ShmfsVnode**)&vnode->private_node, *type, *flags, reenter);
 	},
+
+	.open_index_dir = [](fs_volume* volume, void** cookie) {
+		return static_cast<ShmfsVolume*>(volume->private_volume)->OpenIndexDir(*(ShmfsIndexDirIterator**)cookie);
+	},
+	.close_index_dir = [](fs_volume* volume, void* cookie) {
+		return static_cast<ShmfsVolume*>(volume->private_volume)->CloseIndexDir((ShmfsIndexDirIterator*)cookie);
+	},
+	.free_index_dir_cookie = [](fs_volume* volume, void* cookie) {
+		return static_cast<ShmfsVolume*>(volume->private_volume)->FreeIndexDirCookie((ShmfsIndexDirIterator*)cookie);
+	},
+	.read_index_dir = [](fs_volume* volume, void* cookie, struct dirent* buffer, size_t bufferSize, uint32* num) {
+		return static_cast<ShmfsVolume*>(volume->private_volume)->ReadIndexDir((ShmfsIndexDirIterator*)cookie, buffer, bufferSize, *num);
+	},
+	.rewind_index_dir = [](fs_volume* volume, void* cookie) {
+		return static_cast<ShmfsVolume*>(volume->private_volume)->RewindIndexDir((ShmfsIndexDirIterator*)cookie);
+	},
+	.create_index = [](fs_volume* volume, const char* name, uint32 type, uint32 flags) {
+		return static_cast<ShmfsVolume*>(volume->private_volume)->CreateIndex(name, type, flags);
+	},
+	.remove_index = [](fs_volume* volume, const char* name) {
+		return static_cast<ShmfsVolume*>(volume->private_volume)->RemoveIndex(name);
+	},
+	.read_index_stat = [](fs_volume* volume, const char* name, struct stat* stat) {
+		return static_cast<ShmfsVolume*>(volume->private_volume)->ReadIndexStat(name, *stat);
+	},
+
+	.open_query = [](fs_volume* volume, const char* query, uint32 flags, port_id port, uint32 token, void** cookie) {
+		return static_cast<ShmfsVolume*>(volume->private_volume)->OpenQuery(query, flags, port, token, *(ShmfsQuery**)cookie);
+	},
+	.close_query = [](fs_volume* volume, void* cookie) {
+		return static_cast<ShmfsVolume*>(volume->private_volume)->CloseQuery((ShmfsQuery*)cookie);
+	},
+	.free_query_cookie = [](fs_volume* volume, void* cookie) {
+		return static_cast<ShmfsVolume*>(volume->private_volume)->FreeQueryCookie((ShmfsQuery*)cookie);
+	},
+	.read_query = [](fs_volume* volume, void* cookie, struct dirent* buffer, size_t bufferSize, uint32* num) {
+		return static_cast<ShmfsVolume*>(volume->private_volume)->ReadQuery((ShmfsQuery*)cookie, buffer, bufferSize, *num);
+	},
+	.rewind_query = [](fs_volume* volume, void* cookie) {
+		return static_cast<ShmfsVolume*>(volume->private_volume)->RewindQuery((ShmfsQuery*)cookie);
+	},
 };
 
 static file_system_module_info sModule = {